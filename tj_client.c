@@ -0,0 +1,150 @@
+/*
+ * Project: TJ Shell, a small Linux shell
+ * File: tj_client.c
+ *
+ * Runs a command line or a script in a daemon started with tj_shell -d, as
+ * tj_shell itself would but without the startup of a new shell. Falls back
+ * to running tj_shell if no daemon answers.
+ *
+ * Usage: tj_client -c line | script [args...]
+ *
+ * Compilation: gcc -pedantic -ansi -Wall -Werror -O4 tj_client.c -o tj_client
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define SOCKET_FILE	".tj_socket" /* in HOME, unless TJ_SOCKET is set */
+#define CLIENT_MAX	(1 << 17) /* bytes of a request, as in tj_shell.c */
+
+/*
+ * Start of a request, followed by the working directory, the arguments and
+ * the environment as null-terminated strings, see tj_shell.c.
+ */
+struct client_request {
+	int no_args, no_env;
+};
+
+int connect_daemon();
+int send_request();
+void forward();
+
+pid_t session = 0; /* of the daemon, running the request */
+
+/*
+ * Sends the request and exits with the exit status of the session.
+ */
+int main(int argc, char **argv) {
+	int fd, status;
+	if (argc < 2) {
+		fprintf(stderr, "Usage: tj_client -c line | script [args...]\n");
+		return EXIT_FAILURE;
+	}
+	if ((fd = connect_daemon()) == -1 ||
+		send_request(fd, argc - 1, argv + 1) == -1 ||
+		recv(fd, &session, sizeof(session), 0) != sizeof(session) ||
+		session == -1) {
+		/* No daemon, or it could not take the request */
+		argv[0] = "tj_shell";
+		execvp(argv[0], argv);
+		perror("tj_client");
+		return 127;
+	}
+	/* The session is signalled as a terminal would signal a job */
+	signal(SIGINT, forward);
+	signal(SIGQUIT, forward);
+	signal(SIGTERM, forward);
+	signal(SIGHUP, forward);
+	while (recv(fd, &status, sizeof(status), 0) != sizeof(status)) {
+		if (errno != EINTR) return EXIT_FAILURE;
+	}
+	return status;
+}
+
+/*
+ * Returns a socket connected to the daemon, or -1 if there is none.
+ */
+int connect_daemon(void) {
+	char const *file = getenv("TJ_SOCKET"), *home = getenv("HOME");
+	int fd;
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (file != NULL && strlen(file) < sizeof(addr.sun_path)) {
+		strcpy(addr.sun_path, file);
+	} else if (file == NULL && home != NULL &&
+		strlen(home) + sizeof(SOCKET_FILE) < sizeof(addr.sun_path)) {
+		sprintf(addr.sun_path, "%s/%s", home, SOCKET_FILE);
+	} else {
+		return -1;
+	}
+	if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1) {
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Sends the request to run args with the working directory, environment,
+ * stdin, stdout and stderr of the client. Returns 0 on success, else -1.
+ */
+int send_request(int fd, int no_args, char **args) {
+	extern char **environ;
+	static char buf[CLIENT_MAX];
+	char cbuf[CMSG_SPACE(3 * sizeof(int))], *cwd;
+	int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO}, i, len;
+	struct client_request req;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	struct msghdr msg;
+	if ((cwd = getcwd(NULL, 0)) == NULL) return -1;
+	req.no_args = no_args;
+	len = sizeof(req) + strlen(cwd) + 1;
+	for (i = 0; i < no_args; i++) len += strlen(args[i]) + 1;
+	for (req.no_env = 0; environ[req.no_env] != NULL; req.no_env++) {
+		len += strlen(environ[req.no_env]) + 1;
+	}
+	if (len > CLIENT_MAX) {
+		free(cwd);
+		return -1;
+	}
+	memcpy(buf, &req, sizeof(req));
+	len = sizeof(req);
+	len += sprintf(buf + len, "%s", cwd) + 1;
+	for (i = 0; i < no_args; i++) len += sprintf(buf + len, "%s", args[i]) + 1;
+	for (i = 0; i < req.no_env; i++) {
+		len += sprintf(buf + len, "%s", environ[i]) + 1;
+	}
+	free(cwd);
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(3 * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, 3 * sizeof(int));
+	return (sendmsg(fd, &msg, MSG_NOSIGNAL) == -1 ? -1 : 0);
+}
+
+/*
+ * Forwards signal sig to the process group of the session.
+ */
+void forward(int sig) {
+	if (session > 0) kill(-session, sig);
+}
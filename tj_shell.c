@@ -1,586 +1,6657 @@
-/*
- * Project: TJ Shell, a small Linux shell
- * File: tj_shell.c
- * Author: Tobias Johansson
- * Version: 1.0, 18 May 2015
- *
- * Compilation: gcc -pedantic -ansi -Wall -Werror -O4 -D SIGDET=1 tj_shell.c
- */
-
-#define _GNU_SOURCE
-#include <dirent.h>
-#include <errno.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <sys/time.h>
-#include <sys/wait.h>
-#include <time.h>
-#include <unistd.h>
-/* For detection of terminated background processes by signals sent from the
-   child processes compile with SIGDET=1. If SIGDET is undefined or equals zero
-   then termination will be detected by polling. */
-#if SIGDET != 1
-#define POLLING
-#endif
-#define STR_LEN		(1023)
-#define MAX_CMDS	(63)
-#define MAX_ARGS	(63) /* per command */
-#define PIPING		(no_cmds > 1)
-#define FIRST_CMD	(cmd == 1)
-#define MIDDLE_CMD	(cmd > 1 && cmd < no_cmds)
-#define LAST_CMD	(cmd == no_cmds)
-#define READ_END	(0)
-#define WRITE_END	(1)
-
-/*------------------------------------------------------------------------------
- * PROTOTYPES
- */
-
-/* Called from main */
-void init();
-void prompt();
-/* Excecute commands */
-int exec_cmdline();
-int exec_cmd();
-int fork_exec_wait();
-void c_init();
-int c_wait();
-/* Built in commands */
-void change_dir();
-void check_env();
-void term_all();
-void put_fg();
-/* Helper functions */
-int child_process();
-void get_env_cmd();
-void malloc_strcpy();
-void print_status();
-void stdout_to_pipe();
-void pipe_to_stdin();
-void ten_ms_sleep();
-void tokenize();
-
-/*------------------------------------------------------------------------------
- * GLOBAL VARIABLES
- */
-
-pid_t shell_pid;
-
-/*------------------------------------------------------------------------------
- * SIGNAL HANDLERS
- */
-
-/*
- * Handles SIGCHLD signals or polling if SIGDET!=1.
- */
-void sigchld_handler() {
-	int status;
-	pid_t c_pid;
-
-	/* WUNTRACED: also return if a child has stopped
-	   WNOHANG: return immediately if no child has exited */
-	while ((c_pid = waitpid(WAIT_ANY, &status, WUNTRACED | WNOHANG)) > 0) {
-		print_status(c_pid, status);
-	}
-}
-
-/*
- * Handles SIGINT signals, that is usually Ctrl+C.
- */
-void sigint_handler() {
-	fprintf(stdout, "\n[Ctrl+C]\n");
-	term_all();
-}
-
-/*
- * Handles SIGTSTP signals, that is usually Ctrl+Z.
- */
-void sigtstp_handler() {
-	fprintf(stdout, "\n[Ctrl+Z]\n");
-	if (kill(shell_pid, SIGSTOP) == -1) perror("kill");
-}
-
-/*------------------------------------------------------------------------------
- * MAIN
- */
-
-/*
- * Drives the program.
- */
-int main(int argc, char **argv) {
-	init(argc);
-	#ifdef POLLING
-	fprintf(stdout, "\nWelcome to TJ Shell! (POLLING) \n\n");
-	#else
-	fprintf(stdout, "\nWelcome to TJ Shell! (SIGDET=1) \n\n");
-	#endif
-	while (1) {
-		prompt();
-		ten_ms_sleep(10);
-		#ifdef POLLING
-		sigchld_handler();
-		#endif
-	}
-}
-
-/*------------------------------------------------------------------------------
- * CALLED FROM MAIN
- */
-
-/*
- * Init.
- */
-void init(int argc) {
-	if (argc > 1) {
-		fprintf(stderr, "init: TJ Shell does not take arguments\n");
-		exit(EXIT_FAILURE);
-	}
-	/* If not already:
-	   Set PGID=PID, this makes the shell process group leader.
-	   Take control of the terminal. */
-	shell_pid = getpid();
-	if (setpgid(shell_pid, shell_pid) == -1) {
-		fprintf(stderr, "init: Could not set the shell process group leader\n");
-		exit(EXIT_FAILURE);
-	}
-	signal(SIGINT, sigint_handler);   /* Ctrl+C: terminal interrupt signal */
-	signal(SIGQUIT, SIG_DFL);         /* Ctrl+4: terminal quit signal */
-	signal(SIGTSTP, sigtstp_handler); /* Ctrl+Z: terminal stop signal */
-	signal(SIGTTIN, SIG_IGN);         /* background process attempting read */
-	signal(SIGTTOU, SIG_IGN);         /* background process attempting write */
-	#ifdef POLLING
-	signal(SIGCHLD, SIG_DFL);         /* child process terminated, stopped */
-	#else
-	signal(SIGCHLD, sigchld_handler);
-	#endif
-}
-
-/*
- * Prompt user, get command line and excecute commands.
- */
-void prompt(void) {
-	char c, cwd[STR_LEN+1], line[STR_LEN+1];
-	int i;
-	if (shell_pid != getpid()) {
-		fprintf(stderr, "prompt: Permission for child denied\n");
-		_exit(EXIT_FAILURE);
-	}
-	getcwd(cwd, sizeof(cwd));
-	fprintf(stdout, "%s> ", cwd);
-	for (i = 0; (c = fgetc(stdin)) != '\n'; i++) {
-		line[i] = c;
-	}
-	line[i] = '\0'; /* null-terminate string */
-	if (strlen(line) > 0) exec_cmdline(line);
-}
-
-/*------------------------------------------------------------------------------
- * EXECUTE COMMANDS
- */
-
-/*
- * Takes an unformatted command line and excecutes it. The function tokenize the
- * line for piping and by arguments. If any foreground child fail return a
- * number representing the command that failed there 1 represents the first, 2
- * the second etc., otherwize return 0.
- */
-int exec_cmdline(char const *line) {
-	/* Allocates for arrays of MAX_X strings, last should point to NULL */
-	char **cmds = malloc((MAX_CMDS+1) * sizeof(char *));
-	char **args = malloc((MAX_ARGS+1) * sizeof(char *));
-	char s[STR_LEN+1];
-	int failed_cmd = 0, i, j, no_cmds, no_args;
-	/* Get commands from the command line */
-	tokenize(cmds, &no_cmds, line, "|");
-	/* Execute commands one bye one */
-	for (i = 0; i < no_cmds; i++) {
-		tokenize(args, &no_args, cmds[i], " ");
-		if (no_args == 0) {
-			failed_cmd = i + 1;
-			fprintf(stderr, "exec_cmdline: Empty command\n");
-			break;
-		}
-		if (exec_cmd(args, no_args, i + 1, no_cmds) == -1) {
-			failed_cmd = i + 1;
-			sprintf(s, "%s", args[0]);
-			for (j = 1; j < no_args; j++) sprintf(s, "%s %s", s, args[j]);
-			fprintf(stderr, "exec_cmdline: Command '%s' failed\n", s);
-			break;
-		}
-	}
-	free(cmds);
-	free(args);
-	return failed_cmd;
-}
-
-/*
- * Takes a tokenized command, check for built in command and decides execution.
- * If foreground execution failed return -1, else 0.
- *
- * dtype const **var ⇒ var mutable, *var mutable, **var const
- * (var is a: pointer to pointer to const-dtype)
- */
-int exec_cmd(char const **args, int no_args, int cmd, int no_cmds) {
-	int background = 0;
-	if (no_cmds == 1) {
-		if (strcmp(args[0], "cd") == 0) {
-			if (no_args == 1) {change_dir("~"); return 0;}
-			if (no_args == 2) {change_dir(args[1]); return 0;}
-			return -1;
-		}
-		if (strcmp(args[0], "checkEnv") == 0) {
-			if (no_args <= 2) {check_env(args); return 0;}
-			return -1;
-		}
-		if (strcmp(args[0], "exit") == 0) {
-			if (no_args == 1) {term_all(); return 0;}
-			return -1;
-		}
-		if (strcmp(args[0], "fg") == 0) {
-			if (no_args == 2) {put_fg(args[1]); return 0;}
-			return -1;
-		}
-		/* If background mode */
-		if (strcmp(args[no_args-1], "&") == 0) {
-			if (no_args >= 2) {
-				args[no_args-1] = NULL; /* replace "&" with NULL */
-				background = 1;
-			} else {
-				return -1;
-			}
-		}
-	}
-	/* All other commands: Fork-Exec-Wait (piping in background not allowed) */
-	return fork_exec_wait(args, cmd, no_cmds, background);
-}
-
-/*
- * Forks the process, the child executes a command and the parent waits the
- * child if background is set to 0. Piping can be made for following commands
- * there cmd is 1 for the first command and set 2 for second, etc. The variable
- * no_cmds should be set to number of commands for piping or 1 for a single
- * command. If foreground execution failed return -1, else 0.
- *
- * dtype *const *var ⇒ var mutable, *var const, **var mutable
- * (var is a: pointer to const-pointer to dtype)
- */
-int fork_exec_wait(char *const *args, int cmd, int no_cmds, int background) {
-	static int **pipe_fds, n;
-	struct timeval t0;
-	int i, return_value, status = 0;
-	pid_t c_pid;
-	if (PIPING && FIRST_CMD) {
-		/* Allocates for no_cmds-1 pipes */
-		pipe_fds = malloc((no_cmds - 1) * sizeof(int *));
-		for (i = 0; i < (no_cmds - 1); i++) {
-			/* Allocates for two file descriptors, read and write end */
-			pipe_fds[i] = malloc(2 * sizeof(int));
-			/* Retrive file descriptors */
-			if (pipe(pipe_fds[i]) == -1) {
-				fprintf(stderr, "fork_exec_wait: Could not pipe\n");
-				exit(EXIT_FAILURE);
-			}
-		}
-		n = 0; /* pipe count */
-	}
-	if (PIPING && MIDDLE_CMD) n++;
-	gettimeofday(&t0, NULL); /* start stopwatch */
-	/* Fork */
-	if ((c_pid = fork()) == -1) {
-		fprintf(stderr, "fork_exec_wait: Could not fork\n");
-		exit(EXIT_FAILURE);
-	}
-	/* Exec (child) */
-	else if (c_pid == 0){
-		c_init(!background);
-		if (PIPING) {
-			if (FIRST_CMD) {
-				stdout_to_pipe(pipe_fds[n]);
-			}
-			if (MIDDLE_CMD) {
-				pipe_to_stdin(pipe_fds[n-1]); /* from prev */
-				stdout_to_pipe(pipe_fds[n]);  /* to   next */
-			}
-			if (LAST_CMD) {
-				pipe_to_stdin(pipe_fds[n]);
-			}
-		}
-		/* The arrary position after the last argument must be set to NULL */
-		if (execvp(args[0], args) == -1) {
-			_exit(EXIT_FAILURE);
-		}
-	}
-	/* Wait (parent) */
-	else if (c_pid > 0) {
-		if (PIPING) close(pipe_fds[n][WRITE_END]); /* widowing pipe */
-		if (!background && LAST_CMD) {
-			fprintf(stdout, "[%d] Spawned in foreground\n", c_pid);
-			status = c_wait(c_pid, &t0, 0);
-		} else {
-			fprintf(stdout, "[%d] Spawned in background\n", c_pid);
-		}
-	}
-	if (!background && WEXITSTATUS(status) == EXIT_FAILURE) {
-		return_value = -1;
-	} else {
-		return_value = 0;
-	}
-	if (PIPING && (LAST_CMD || (return_value == -1))) free(pipe_fds);
-	return return_value;
-}
-
-/*
- * Init child.
- */
-void c_init(int foreground) {
-	/* Make the child leader of a new process group */
-	pid_t c_pid = getpid();
-	setpgid(c_pid, c_pid);
-	if (foreground) {
-		/* The child takes the terminal */
-		if (tcsetpgrp(STDIN_FILENO, getpgid(c_pid)) == -1) perror("tcsetpgrp");
-	}
-	/* Signal handling to default */
-	signal(SIGINT , SIG_DFL);
-	signal(SIGQUIT, SIG_DFL);
-	signal(SIGTSTP, SIG_DFL);
-	signal(SIGTTIN, SIG_DFL);
-	signal(SIGTTOU, SIG_DFL);
-	signal(SIGCHLD, SIG_DFL);
-}
-
-/*
- * Waits for a child in the foreground. If process is in background set cont=1
- * for give over the terminal and continue the process, otherwise set 0. Returns
- * status from waitpid.
- */
-int c_wait(pid_t c_pid, struct timeval const *t0, int cont) {
-	int status;
-	struct timeval t1, diff;
-	if (cont) {
-		if (tcsetpgrp(STDIN_FILENO, getpgid(c_pid)) == -1) perror("tcsetpgrp");
-		if (kill(c_pid, SIGCONT) == -1) perror("kill");
-	}
-	/* Wait for childs death, WUNTRACED: also return if a child has stopped */
-	if (waitpid(c_pid, &status, WUNTRACED) > 0) {
-		print_status(c_pid, status);
-		if (t0 != NULL) {
-			gettimeofday(&t1, NULL); /* stop stopwatch */
-			diff.tv_sec = t1.tv_sec - t0->tv_sec;
-			diff.tv_usec = t1.tv_usec - t0->tv_usec;
-			fprintf(stdout, "Run time was %.0f ms\n",
-				diff.tv_sec * 1000.0 + diff.tv_usec / 1000.0);
-		}
-	}
-	/* Reclaim the terminal */
-	if (tcsetpgrp(STDIN_FILENO, getpgid(shell_pid)) == -1) perror("tcsetpgrp");
-	return status;
-}
-
-/*------------------------------------------------------------------------------
- * BUILT IN COMMANDS
- */
-
-/*
- * Change directory.
- */
-void change_dir(char const *path) {
-	int i, path_len = strlen(path);
-	char exec_path[STR_LEN+1], s[STR_LEN+1];
-	if (path[0] == '~') {
-		/* Replace tilde by HOME environment */
-		for (i = 1; i < path_len + 1; i++) s[i-1] = path[i];
-			sprintf(exec_path, "%s%s", getenv("HOME"), s);
-	} else {
-		sprintf(exec_path, "%s", path);
-	}
-	if (chdir(exec_path) == -1) {
-		fprintf(stderr, "change_dir: No such directory\n");
-	}
-}
-
-/* A built-in command "checkEnv" which executes "printenv | sort | pager" if no
- * arguments are given to the command. If arguments are passed to the command
- * then "printenv | grep <arguments> | sort | pager" executes. The pager
- * executed is selected primarily based on the value of the users "PAGER"
- * environment variable. If no such variable is set then first try to execute
- * "less" and if that fails "more".
- *
- * dtype const *const *var ⇒ var mutable, *var const, **var const
- * (var is a: pointer to const-pointer to const-dtype)
- */
-void check_env(char const *const *args) {
-	char line[STR_LEN+1], pager[STR_LEN+1];
-	int no_cmds = (args[1] == NULL ? 3 : 4);
-	if (getenv("PAGER") != NULL) {
-		sprintf(pager, "%s", getenv("PAGER"));
-	} else {
-		sprintf(pager, "less");
-	}
-	get_env_cmd(line, args, pager);
-	fprintf(stdout, "Actual command line: %s\n", line);
-	if (exec_cmdline(line) == no_cmds && strcmp(pager, "less") == 0) {
-		/* If less failed */
-		get_env_cmd(line, args, "more");
-		fprintf(stdout, "Actual command line: %s\n", line);
-		exec_cmdline(line);
-	}
-}
-
-/*
- * Terminates all children in an orderly manner.
- */
-void term_all(void) {
-	char path[STR_LEN+1];
-	DIR *dirp;
-	FILE *fp;
-	pid_t pid, ppid;
-	struct dirent* dent;
-	fprintf(stdout, "\nTJ Shell closing...\n\n");
-	if ((dirp = opendir("/proc")) == NULL) {
-		fprintf(stderr, "term_all: Could not open '/proc'\n");
-		exit(EXIT_FAILURE);
-	}
-	/* Searches through all directories in /proc */
-	while((dent = readdir(dirp)) != NULL) {
-		/* If numerical */
-		if (dent->d_name[0] >= '0' && dent->d_name[0] <= '9') {
-			/* Take data from /proc/[pid]/stat, see URL below for more info.
-			   http://man7.org/linux/man-pages/man5/proc.5.html */
-			sprintf(path, "/proc/%s/stat", dent->d_name);
-			fp = fopen(path,"r");
-			fscanf(fp, "%d %*s %*c %d", &pid, &ppid);
-			fclose(fp);
-			/* Kill if shell is parent to process */
-			if (shell_pid == ppid) if (kill(pid, SIGKILL) == -1) perror("kill");
-		}
-	}
-	closedir(dirp);
-	ten_ms_sleep(10); /* wait for SIGKILL signals to terminate bg processes */
-	#ifdef POLLING
-	sigchld_handler();
-	#endif
-	exit(EXIT_SUCCESS);
-}
-
-/*
- * Put background process in the foreground.
- */
-void put_fg(char const *s) {
-	pid_t c_pid;
-	sscanf(s, "%d", &c_pid);
-	if (child_process(c_pid)) {
-		c_wait(c_pid, NULL, 1);
-	} else {
-		fprintf(stderr, "put_fg: No such child\n");
-	}
-}
-
-/*------------------------------------------------------------------------------
- * HELPER FUNCTIONS
- */
-
-/*
- * Returns 1 if given pid is a child process, else 0.
- */
-int child_process(pid_t c_pid) {
-	char path[STR_LEN+1];
-	FILE *fp;
-	pid_t ppid;
-	sprintf(path, "/proc/%d/stat", c_pid);
-	if ((fp = fopen(path,"r")) == NULL) return 0;
-	fscanf(fp, "%*d %*s %*c %d", &ppid);
-	fclose(fp);
-	if (ppid == shell_pid) {
-		return 1;
-	} else {
-		return 0;
-	}
-}
-
-/*
- * Get command line for check of enviroment.
- *
- * dtype const *const *var ⇒ var mutable, var* const, var** const
- * (var is a: pointer to const-pointer to const-dtype)
- */
-void get_env_cmd(char *line, char const *const *args, char const *pager) {
-	if (args[1] == NULL) {
-		sprintf(line, "printenv | sort | %s", pager);
-	} else {
-		sprintf(line, "printenv | sort | grep %s | %s", args[1], pager);
-	}
-}
-
-/*
- * Takes dest a pointer to a string and src the source string. The function
- * allocates memory for dest and copies src to it.
- */
-void malloc_strcpy(char **dest, char const *src) {
-	if (src == NULL) {*dest = NULL; return;}
-	*dest = malloc((strlen(src)+1) * sizeof(char)); /* +1 for null-terminated */
-	sprintf(*dest, "%s", src);
-}
-
-/*
- * Print childs wait status.
- */
-void print_status(pid_t c_pid, int status) {
-	if (WIFEXITED(status)) {
-		fprintf(stdout, "[%d] Terminated normally\n", c_pid);
-	} else if (WIFSIGNALED(status)) {
-		fprintf(stdout, "[%d] Terminated by a signal\n", c_pid);
-	} else if (WIFSTOPPED(status)) {
-		fprintf(stdout, "[%d] Stopped\n", c_pid);
-	}
-}
-
-/*
- * Pipes stdout to a pipe.
- */
-void stdout_to_pipe(int const *pipe_fd) {
-	close(pipe_fd[READ_END]);
-	close(STDOUT_FILENO);
-	if (dup2(pipe_fd[WRITE_END], STDOUT_FILENO) == -1) perror("dup2");
-}
-
-/*
- * Pipes a pipe to stdin.
- */
-void pipe_to_stdin(int const *pipe_fd) {
-	close(pipe_fd[WRITE_END]);
-	close(STDIN_FILENO);
-	if (dup2(pipe_fd[READ_END], STDIN_FILENO) == -1) perror("dup2");
-}
-
-/*
- * Sleeps ten milliseconds using nanosleep for so many times that is given.
- */
-void ten_ms_sleep(int times) {
-	int i;
-	struct timespec ts;
-	ts.tv_sec = 0;
-	ts.tv_nsec = 10000000; /* 10 ms */
-	/* Nanosleep gets interupted by signals */
-	for (i = 0; i < times; i++) {
-		nanosleep(&ts, NULL);
-	}
-}
-
-/*
- * Tokenizes a string for specified delimiters. The variable strs is an array of
- * unallocated strings and no_strs gives the number of output strings. The
- * allocation after the last string in strs is set to NULL.
- */
-void tokenize(char **strs, int *no_strs, char const *input, char const *delim) {
-	char *s;
-	int i;
-	malloc_strcpy(&s, input);
-	malloc_strcpy(&strs[i = 0], strtok(s, delim));
-	while(strs[i] != NULL) {
-		malloc_strcpy(&strs[++i], strtok(NULL, delim));
-	}
-	*no_strs = i;
-	free(s);
-}
+/*
+ * Project: TJ Shell, a small Linux shell
+ * File: tj_shell.c
+ * Author: Tobias Johansson
+ * Version: 1.0, 18 May 2015
+ *
+ * Compilation: gcc -pedantic -ansi -Wall -Werror -O4 -D SIGDET=1 -pthread tj_shell.c
+ */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <regex.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+/* Since glibc 2.35 posix_spawn() can hand the terminal to the child */
+#ifdef __GLIBC_PREREQ
+#if __GLIBC_PREREQ(2, 35)
+#define SPAWN_TCSETPGRP
+#endif
+#endif
+/* For detection of terminated background processes by signals sent from the
+   child processes compile with SIGDET=1. If SIGDET is undefined or equals zero
+   then termination will be detected by polling. */
+#if SIGDET != 1
+#define POLLING
+#endif
+#define STR_LEN		(1023)
+#define MAX_CMDS	(63)
+#define MAX_ARGS	(63) /* per command */
+#define PIPING		(no_cmds > 1)
+#define FIRST_CMD	(cmd == 1)
+#define MIDDLE_CMD	(cmd > 1 && cmd < no_cmds)
+#define LAST_CMD	(cmd == no_cmds)
+#define READ_END	(0)
+#define WRITE_END	(1)
+#define MAX_BLOCKS	(63) /* nested loops and conditionals per script */
+#define BREAK_MARK(d)	(-2 - (d)) /* unpatched jump target of a break */
+/* Script bytecode operations, see struct insn for the operands a, b and c */
+#define OP_SPAWN	(0) /* run pipeline a */
+#define OP_TEST		(1) /* run pipeline a, condition is true if status is 0 */
+#define OP_JUMP		(2) /* jump to a */
+#define OP_JUMP_FALSE	(3) /* jump to a if the condition is false */
+#define OP_SET		(4) /* set variable a to the expansion of string b */
+#define OP_FOR_INIT	(5) /* expand and split string b into loop slot a */
+#define OP_FOR_NEXT	(6) /* set variable b to next word of slot a, or jump c */
+#define OP_EXIT		(7) /* stop with status a, or last status if a < 0 */
+#define NO_OPS		(8)
+#define VAR_BUCKETS	(512) /* power of two */
+#define JOBS_MIN	(64) /* power of two, first size of the job table */
+#define JOB_CMD		(127) /* characters of the command kept for jobs */
+#define JOB_RUNNING	(0)
+#define JOB_STOPPED	(1)
+#define JOB_DONE	(2)
+#define SIG_RING	(1024) /* power of two, records of caught signals */
+#define PROMPT_DEFAULT	"%d> " /* see render_prompt() for the segments */
+#define PROMPT_WAIT	(20) /* ms to wait for the branch of a new directory */
+#define HIST_MAGIC	(0x544a4831) /* "TJH1", starts each history record */
+#define HIST_FILE	".tj_history" /* in HOME, unless TJ_HISTFILE is set */
+#define HIST_USED	(1U << 24) /* marks a used slot of the trigram index */
+#define DIRS_FILE	".tj_dirs" /* in HOME, unless TJ_DIRSFILE is set */
+#define MAX_DIRS	(1024) /* slots of the directory database */
+#define DIRS_AGING	(5000) /* total rank at which all ranks are aged */
+#define COMPLETE_WAIT	(30) /* ms that Tab waits for directory scans */
+#define MAX_LISTED	(100) /* completions listed by a second Tab */
+#define SPAWNERS	(4) /* threads spawning the stages of pipelines */
+#define ZYGOTE_MAX	(1 << 17) /* bytes of a spawn request, else fork */
+#define SOCKET_FILE	".tj_socket" /* in HOME, unless TJ_SOCKET is set */
+#define CLIENT_MAX	(1 << 17) /* bytes of a request to the daemon */
+#define SESSIONS_PER_CPU	(4) /* running sessions of the daemon */
+#define BENCH_MB	(256) /* MB through the pipe by bench */
+#define BENCH_BLOCK	(1 << 16) /* bytes per write by bench */
+#define NICE_DEFAULT	(10) /* added by nice without -n */
+#define IOPRIO(c, l)	((c) << 13 | (l)) /* I/O class and level */
+#define IOPRIO_IDLE	IOPRIO(3, 0)
+#define CGROUP_ROOT	"/sys/fs/cgroup" /* where cgroup v2 is mounted */
+#define CPU_PERIOD	(100000) /* us, of cpu.max */
+#define TIMEOUT_GRACE	(2000) /* ms from SIGTERM to SIGKILL on timeout */
+#define TIMED_OUT	(124) /* exit status, as of timeout(1) */
+#define DEBOUNCE	(100) /* ms without changes before onchange reruns */
+#define WATCH_EVENTS	(IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVE | \
+	IN_DELETE_SELF | IN_MOVE_SELF | IN_ATTRIB)
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP	((uint64_t)1 << 33)
+#endif
+#define CTRL_KEY(c)	((c) & 0x1f)
+#define UTF8_CONT(c)	(((c) & 0xc0) == 0x80) /* continuation byte */
+#define CACHE_MAGIC	"TJSHBC1" /* compiled script cache, bump on changes */
+/* Script blocks while compiling */
+#define BLOCK_WHILE	(0)
+#define BLOCK_FOR	(1)
+#define BLOCK_IF	(2)
+#define BLOCK_ELSE	(3)
+
+/*------------------------------------------------------------------------------
+ * TYPES
+ */
+
+/*
+ * One bytecode instruction.
+ */
+struct insn {
+	int op;
+	int a, b, c;
+};
+
+/*
+ * A compiled script. Parts refer to each other by offsets and never by
+ * pointers. A pipeline at pool offset p is stored as the number of commands
+ * followed by, for each command, the number of arguments and the arguments.
+ * An argument is a string offset shifted left one bit, the low bit is set if
+ * the argument has to be expanded when the pipeline runs.
+ */
+struct program {
+	struct insn *code;
+	int no_insns, code_cap;
+	int *pool;
+	int no_pool, pool_cap;
+	char *strs;
+	int strs_len, strs_cap;
+	int no_loops;
+	void *map; /* if loaded from the cache, else NULL */
+	size_t map_len;
+	struct resolved **resolved; /* by pool offset, see exec_pipeline() */
+};
+
+/*
+ * Start of a compiled script in the cache, followed by the code, the pool and
+ * the strings. The script is identified by the hash of its path, its size and
+ * modification time and the hash of its content.
+ */
+struct program_header {
+	char magic[8];
+	unsigned long path_hash, size, mtime_sec, mtime_nsec, hash;
+	int no_insns, no_pool, strs_len, no_loops;
+};
+
+/*
+ * An open block while compiling a script. The pc is the instruction that is
+ * jumped to by continue for loops, or the jump to patch for conditionals.
+ */
+struct block {
+	int type;
+	int pc;
+};
+
+/*
+ * Words of a running for-loop.
+ */
+struct vm_loop {
+	char **words;
+	int no_words, next;
+};
+
+/*
+ * State of the bytecode interpreter.
+ */
+struct vm {
+	struct program const *prog;
+	struct vm_loop *loops;
+	int pc, cond;
+};
+
+/*
+ * A shell variable, chained in a bucket of a hash table. The same table type
+ * caches the paths of commands, then value is the path.
+ */
+struct var {
+	char *name, *value;
+	int exported;
+	struct var *next;
+};
+
+/*
+ * State of the line editor. Besides the line being edited, it remembers what
+ * is on the terminal so that a refresh only writes what changed.
+ */
+struct editor {
+	char const *format;  /* of the prompt */
+	char *prompt;
+	char *buf;           /* the line, null-terminated */
+	int len, cap, pos;   /* pos is the byte of the cursor */
+	int offset;          /* first byte shown, for lines wider than cols */
+	int cols;
+	char *shown;         /* what is on the terminal row, from column 0 */
+	int shown_len, shown_col;
+	int history;         /* index in history while browsing */
+	char *saved;         /* the new line while browsing history */
+	char *query;         /* while searching the history with Ctrl+R */
+	int match;           /* entry found by the search, or -1 */
+	char *saved_prompt;  /* the prompt while searching */
+	int tabs;            /* Tab presses in a row */
+	int pending;         /* a completion waits for a directory scan */
+};
+
+/*
+ * A history record in the history file, followed by the null-terminated line
+ * padded to a multiple of 8 bytes. Sessions append whole records with one
+ * write() each to the file opened with O_APPEND, so records of concurrent
+ * sessions never mix. Records are numbered by seq across sessions: a session
+ * appends under an flock() of the file, after reading the records of the
+ * others, and continues after the highest number in the file.
+ */
+struct hist_record {
+	unsigned int magic, len, seq, pid;
+	long time;
+};
+
+/*
+ * The history entries containing a trigram (three bytes), in order.
+ */
+struct trigram {
+	unsigned int key; /* the bytes, with HIST_USED set */
+	int *ids, n, cap;
+};
+
+/*
+ * The history, mapped from the history file. The trigram index is an open
+ * addressing hash table, the entries are added to it as they are read.
+ */
+struct history {
+	int fd;
+	char *map;
+	size_t map_len, scanned;  /* scanned bytes of the file */
+	size_t *offsets;          /* of the records of the entries */
+	int n, cap;
+	struct trigram *index;
+	size_t index_cap, index_used; /* slots, a power of two, and used ones */
+	int indexed;
+	unsigned int seq;
+};
+
+/*
+ * The names in a directory, as scanned by the scan worker, NULL-terminated.
+ * The types are 'd' for directories, 'x' for executable files and 'f' for
+ * other files. The same struct is the request to the worker and the answer.
+ */
+struct dir_list {
+	char *path;
+	long mtime_sec, mtime_nsec;
+	char **names;
+	char *types;
+	int no_names;
+	int scanning;         /* a scan is on its way */
+	struct dir_list *next;
+};
+
+/*
+ * A node of the command trie, the children of a node are linked by next.
+ */
+struct trie {
+	char c;
+	int end; /* a command ends here */
+	struct trie *child, *next;
+};
+
+/*
+ * How many times a word occurs in the history.
+ */
+struct word_count {
+	char *word;
+	int n;
+	struct word_count *next;
+};
+
+/*
+ * Words that complete a word, ranked by how often they occur in the history.
+ */
+struct candidate {
+	char *word;
+	int rank;
+};
+struct completion {
+	struct candidate *cands;
+	int no_cands, cap;
+};
+
+/*
+ * A directory in the directory database, an empty path is a free slot. The
+ * rank counts visits and is aged, see dirs_visit(). The slots are 256 bytes.
+ */
+struct dir_slot {
+	double rank;
+	long time; /* of the last visit */
+	char path[256 - sizeof(double) - sizeof(long)];
+};
+
+/*
+ * A directory of the database with its score, for sorting.
+ */
+struct dir_score {
+	double score;
+	int slot;
+};
+
+/*
+ * How the commands of a job are placed and scheduled, set by the prefixes of
+ * its pipeline, see job_prefix().
+ */
+struct job_opts {
+	int pin;    /* pin the stages to CPUs, or -1 for TJ_PIN */
+	int nice;   /* added to the niceness */
+	int policy; /* SCHED_BATCH or SCHED_IDLE, or -1 to keep it */
+	int ioprio; /* I/O class and level, or -1 to keep it */
+	long mem_mb, cpu_sec, files; /* resource limits, 0 for none */
+	int cpu_pct; /* CPU bandwidth in percent of a CPU, 0 for no limit */
+	int cgroup;  /* directory of the cgroup of the job, or -1 */
+	long timeout_ms; /* 0 for none */
+	long every_ms; /* run the pipeline periodically, see run_every() */
+	int every_count; /* times to run it, 0 until stopped */
+	int watch_fd; /* inotify of onchange, or -1, see run_onchange() */
+	struct watch *watches;
+	int no_watches;
+	char const *changed; /* the path of the last change seen, or NULL */
+	char cmd[JOB_CMD+1]; /* the pipeline, for jobs */
+};
+
+/*
+ * A background or stopped child of the shell, job %id in jobs[id]. The jobs
+ * of the same hash of the pid are chained through next, see job_of(). A job
+ * that is done keeps its slot until its status is listed or waited for, and
+ * the table doubles when it is full.
+ */
+struct job_slot {
+	pid_t pid;  /* 0 if the slot is free */
+	pid_t pgid; /* signalled as a group if above 0 */
+	int state;  /* JOB_RUNNING, JOB_STOPPED or JOB_DONE */
+	int status; /* exit status when done, 128 + the signal when stopped */
+	int next;   /* id of the next job of the same hash, or 0 */
+	char cmd[JOB_CMD+1];
+};
+
+/*
+ * A path watched by onchange, wd is -1 when it is not watched, as when the
+ * file was replaced.
+ */
+struct watch {
+	int wd;
+	char *path;
+};
+
+/*
+ * A file descriptor watched by the event loop, fn is called with arg when it
+ * is readable.
+ */
+struct event {
+	int fd;
+	void (*fn)(void *);
+	void *arg;
+};
+
+/*
+ * The timeout of a job, the timerfd fd signals the processes pids in the
+ * process groups pgids when it expires. It is freed when the processes are
+ * reaped and it is not held by the pipeline being started.
+ */
+struct timer {
+	int fd;    /* -1 when disarmed */
+	int fired; /* SIGTERM was sent */
+	int cancelled; /* by timer_cancel(), so not timed out */
+	int held;
+	pid_t pids[MAX_CMDS], pgids[MAX_CMDS];
+	int no_pids;
+	struct timer *next;
+};
+
+/*
+ * A cgroup made for a job, removed when the job is done.
+ */
+struct job_cgroup {
+	char *path;
+	struct job_cgroup *next;
+};
+
+/*
+ * For sched_setattr(), which glibc has no wrapper for.
+ */
+struct sched_attr {
+	uint32_t size;
+	uint32_t sched_policy;
+	uint64_t sched_flags;
+	int32_t sched_nice;
+	uint32_t sched_priority;
+	uint64_t sched_runtime, sched_deadline, sched_period;
+};
+
+/*
+ * For clone3(), which glibc has no wrapper for.
+ */
+struct clone_args {
+	uint64_t flags, pidfd, child_tid, parent_tid, exit_signal;
+	uint64_t stack, stack_size, tls, set_tid, set_tid_size, cgroup;
+};
+
+/*
+ * Start of a spawn request to the zygote, followed by the path, the
+ * arguments and the environment as null-terminated strings. The cgroup of
+ * the job, if any, is passed as a file descriptor.
+ */
+struct spawn_request {
+	int foreground;
+	pid_t pgid; /* to join, or 0 for a new process group */
+	int interactive; /* of the shell, which run_every() turns off */
+	int cpu; /* to pin the command to, or -1 */
+	struct job_opts opts;
+	int no_args, no_env;
+};
+
+/*
+ * Start of a request from tj_client to the daemon, followed by the working
+ * directory, the arguments and the environment as null-terminated strings.
+ * stdin, stdout and stderr of the client are passed as file descriptors.
+ */
+struct client_request {
+	int no_args, no_env;
+};
+
+/*
+ * A session of the daemon, the child pid running the request of a client
+ * connected on conn. Until it is started the request is kept in req, with
+ * the file descriptors of the client in fds, queued at its owner.
+ */
+struct session {
+	pid_t pid;   /* 0 until started */
+	int conn;
+	int pidfd;   /* of pid, in the event loop, or -1 */
+	int watched; /* conn is in the event loop */
+	pid_t runs_for; /* the parent of the client, see struct owner */
+	char *req;
+	int fds[3];
+	struct owner *owner;
+	struct session *next; /* in the queue of the owner */
+};
+
+/*
+ * A process that clients of the daemon run for, as a build tool that runs
+ * many of them. The owners take turns at starting their queued sessions.
+ */
+struct owner {
+	pid_t pid;
+	int no_sessions; /* running and queued */
+	struct session *queue, *last;
+	struct owner *next; /* in the ring of turns */
+};
+
+/*
+ * The answer of the zygote: the pid of the child, or -1, and the errno if
+ * exec failed, else 0.
+ */
+struct spawn_reply {
+	pid_t pid;
+	int err;
+};
+
+/*
+ * A stage of a pipeline for the spawner threads, cmd is 1 for the first.
+ */
+struct stage {
+	int cmd;
+	char const *path;
+	char *const *args, *const *env;
+	int in, out; /* stdin and stdout of the command */
+	int cpu;     /* to pin the command to, or -1 */
+	pid_t pid;   /* -1 if it was not spawned */
+	int err;     /* errno if exec failed, else 0 */
+};
+
+/*
+ * A signal caught by sig_catch(), for sig_drain() to act on. A SIGCHLD record
+ * is a child pid reaped with its wait status.
+ */
+struct sig_record {
+	int sig;
+	pid_t pid;
+	int status;
+	struct timespec at; /* CLOCK_MONOTONIC when caught or reaped */
+};
+
+/*
+ * A CPU with the first CPUs of the groups sharing its L2 and L3 caches, -1 if
+ * the cache is not known.
+ */
+struct cpu_place {
+	int cpu, l2, l3;
+};
+
+/*
+ * A built in command takes the number of arguments and the arguments with the
+ * command name first, and returns an exit status.
+ */
+typedef int (*builtin_fn)();
+
+/*
+ * What the commands of a pipeline resolve to: the built in, or else the path
+ * of the executable, or NULL and the errno that exec would fail with. Kept
+ * per pipeline of a script while gen is cmd_gen, with its prefixes.
+ */
+struct resolved {
+	struct job_opts job; /* as taken from the prefixes */
+	int prefix_len;      /* words of the prefixes */
+	unsigned long gen;
+	builtin_fn builtins[MAX_CMDS];
+	char const *paths[MAX_CMDS];
+	int errs[MAX_CMDS];
+};
+
+/*------------------------------------------------------------------------------
+ * PROTOTYPES
+ */
+
+/* Called from main */
+void init();
+int run_args();
+void prompt();
+/* Signals */
+void sig_catch();
+void sig_push();
+void reap_children();
+void sig_wake();
+void sig_handle();
+void sig_init();
+void sig_drain();
+/* Prompt */
+char const *render_prompt();
+void vcs_request();
+int vcs_collect();
+void *vcs_worker();
+char *vcs_branch();
+/* Line editor */
+char *read_line();
+char *edit_line();
+int edit_key();
+void edit_insert();
+void edit_delete();
+void edit_set();
+void edit_history();
+int edit_search();
+void edit_refresh();
+int columns();
+int fit_columns();
+int raw_mode();
+/* History */
+int hist_open();
+void hist_sync();
+char const *hist_line();
+void add_history();
+void hist_index();
+struct trigram *trigram_find();
+int hist_search();
+/* Completion */
+void edit_complete();
+int complete_command();
+int complete_file();
+void add_candidate();
+int compare_candidates();
+int build_trie();
+void trie_add();
+void trie_collect();
+void trie_free();
+struct dir_list *dir_scan();
+struct dir_list *dir_lookup();
+void scan_collect();
+void *scan_worker();
+void scan_dir();
+int word_rank();
+/* Working directory */
+void cwd_init();
+void set_cwd();
+char const *get_cwd();
+char *logical_path();
+/* Excecute commands */
+int exec_cmdline();
+int exec_pipeline();
+void resolve_cmds();
+int exec_job();
+int exec_cmd();
+int fork_exec_wait();
+int spawn_pipeline();
+void *spawn_worker();
+void spawn_stage();
+void c_init();
+int job_prefix();
+void set_sched();
+void set_limits();
+int job_plain();
+int job_pgrp();
+int stage_cpu();
+int cpu_topology();
+int cache_group();
+int compare_places();
+void pin_cpu();
+int c_wait();
+pid_t wait_events();
+void zygote_start();
+void zygote_main();
+pid_t zygote_spawn();
+int exec_error();
+void exec_failed();
+/* Built in commands */
+builtin_fn find_builtin();
+int builtin_cd();
+int builtin_bench();
+int builtin_bg();
+int builtin_check_env();
+int builtin_exit();
+int builtin_export();
+int builtin_fg();
+int builtin_hash();
+int builtin_j();
+int builtin_jobs();
+int builtin_kill();
+int builtin_local();
+int builtin_unset();
+int builtin_wait();
+int builtin_waitfor();
+char *watch_dir();
+int change_dir();
+int bench_pipe();
+int dirs_open();
+void dirs_visit();
+double dirs_score();
+int compare_scores();
+int jump_dir();
+void list_dirs();
+void check_env();
+void term_all();
+/* Every */
+int run_every();
+void every_key();
+long every_run();
+void every_draw();
+/* Onchange */
+int run_onchange();
+void watch_event();
+int watch_paths();
+/* Events */
+int ev_add();
+void ev_del();
+int ev_run_once();
+void ev_flag();
+struct timer *timer_start();
+void timer_arm();
+void timer_add();
+void timer_fire();
+void timer_cancel();
+int timer_reaped();
+void timers_collect();
+long parse_duration();
+/* Cgroups */
+int cgroup_init();
+int cgroup_create();
+void cgroup_reap();
+int cgroup_write();
+long cgroup_read();
+/* Daemon */
+int serve();
+void serve_conn();
+int serve_request();
+void serve_next();
+void serve_reap();
+void serve_session();
+void session_end();
+pid_t parent_pid();
+void warm_commands();
+/* Variables */
+void vars_init();
+void vars_import();
+struct var *var_lookup();
+char const *var_get();
+void var_set();
+void var_unset();
+int var_assign();
+char *const *get_envp();
+char const *find_command();
+void forget_commands();
+int valid_name();
+/* Scripts */
+int run_script();
+int load_script();
+int load_cached();
+int valid_pipeline();
+void store_cached();
+char *cache_file();
+int compile_script();
+int compile_line();
+int compile_pipeline();
+int prog_emit();
+int prog_int();
+int prog_str();
+void free_program();
+int run_program();
+void vm_spawn();
+void vm_test();
+void vm_jump();
+void vm_jump_false();
+void vm_set();
+void vm_for_init();
+void vm_for_next();
+void vm_exit();
+/* Helper functions */
+int job_of();
+int add_job();
+void update_job();
+void free_job();
+int find_job();
+int other_children();
+int signal_job();
+void wait_job_event();
+char *expand_word();
+unsigned long fnv1a();
+void free_strs();
+void *grow();
+void malloc_strcpy();
+int page();
+void print_status();
+void sort_strs();
+int start_worker();
+void stdout_to_pipe();
+void pipe_to_stdin();
+void ten_ms_sleep();
+void tokenize();
+int write_all();
+
+/*------------------------------------------------------------------------------
+ * GLOBAL VARIABLES
+ */
+
+pid_t shell_pid;
+int interactive = 1; /* 0 when running a script */
+int last_status = 0; /* exit status of the last foreground pipeline */
+struct var *vars[VAR_BUCKETS];      /* shell variables */
+struct var *cmd_paths[VAR_BUCKETS]; /* found paths of commands */
+unsigned long cmd_gen = 1;          /* changed when they are forgotten */
+struct resolved *resolved_cmds = NULL; /* of the pipeline being run */
+char **envp = NULL;  /* exported variables for execve, see get_envp() */
+int envp_dirty = 1;  /* set when an exported variable changes */
+char *cwd = NULL;    /* logical working directory, see cwd_init() */
+int cwd_fd = -1;     /* the working directory when cwd was set */
+long last_runtime = 0; /* ms, of the last foreground pipeline */
+int zygote_fd = -1;    /* socket to the zygote, see zygote_start() */
+pid_t zygote_pid = -1;
+int server_fd = -1; /* socket of the daemon, see serve() */
+struct owner *owner_turn = NULL; /* ring of the owners of sessions */
+int no_running = 0, max_running = 0; /* sessions */
+/* Stages of pipelines are spawned by a pool of spawner threads. The shell
+   hands out the stages in spawn_stages and waits until spawn_done of them are
+   spawned, all under spawn_lock. The first stage publishes spawn_pgid. */
+pthread_mutex_t spawn_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t spawn_cond = PTHREAD_COND_INITIALIZER;
+struct stage *spawn_stages = NULL;
+int spawn_next = 0, spawn_total = 0, spawn_done = 0, no_spawners = 0;
+int spawn_failed = 0; /* the remaining stages are not spawned */
+struct job_opts job; /* of the running pipeline */
+char *cgroup_base = NULL; /* cgroup of the shell, see cgroup_init() */
+int cgroup_tried = 0, no_job_cgroups = 0;
+struct job_cgroup *job_cgroups = NULL; /* not yet removed */
+int ev_epoll = -1, no_events = 0; /* see ev_add() */
+struct event **events = NULL; /* by file descriptor */
+int ev_cap = 0;
+int chld_fd = -1; /* signalfd for SIGCHLD, see wait_events() */
+struct timer *timers = NULL, *job_timer = NULL; /* of the running pipeline */
+int cpu_order[CPU_SETSIZE], no_cpus = -1; /* see cpu_topology() */
+cpu_set_t shell_cpus;
+pid_t spawn_pgid = 0;
+pid_t job_pgid = 0; /* of the running pipeline once spawned, see job_pgrp() */
+struct job_slot *jobs = NULL; /* by id, jobs[0] is not used */
+int *job_buckets = NULL;      /* first id of each hash of a pid, or 0 */
+int job_cap = 0;              /* slots, and buckets, a power of two */
+int no_jobs = 0;     /* running and stopped */
+int job_current = 0; /* the latest started or stopped, for fg and bg */
+/* Signals are recorded in sig_ring by the handler, the only producer, which
+   advances sig_head, and acted on by sig_drain(), the only consumer, which
+   advances sig_tail. Both run on the main thread, the workers block all
+   signals, so the handler only has to see the latest sig_tail. A byte on
+   sig_pipe wakes the event loop. */
+struct sig_record sig_ring[SIG_RING];
+volatile unsigned long sig_head = 0, sig_tail = 0;
+volatile sig_atomic_t sig_full = 0; /* children were left to reap */
+int sig_pipe[2] = {-1, -1};
+int term_resized = 0; /* a SIGWINCH was drained, see edit_line() */
+/* The branch segment of the prompt is found by a worker thread. The shell
+   asks for the branch of a directory in vcs_dir and the worker answers in
+   vcs_branch_of, both under vcs_lock, and notifies the shell on vcs_pipe. */
+pthread_mutex_t vcs_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t vcs_cond = PTHREAD_COND_INITIALIZER;
+char *vcs_dir = NULL, *vcs_done_dir = NULL, *vcs_branch_of = NULL;
+int vcs_pipe[2] = {-1, -1};
+struct var *vcs_cache[VAR_BUCKETS]; /* branch by directory, "" if none */
+struct history hist = {-1};
+struct dir_slot *dirs = NULL; /* the directory database, see dirs_open() */
+int dirs_fd = -1;
+/* Directories are scanned for completion by another worker thread. The shell
+   queues requests in scan_todo and the worker moves them to scan_done, both
+   under scan_lock, and notifies the shell on scan_pipe. */
+pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t scan_cond = PTHREAD_COND_INITIALIZER;
+struct dir_list *scan_todo = NULL, *scan_done = NULL;
+int scan_pipe[2] = {-1, -1};
+struct dir_list *dir_cache[VAR_BUCKETS];   /* by path */
+struct trie *cmd_trie = NULL;              /* commands in PATH, when built */
+struct word_count *word_counts[VAR_BUCKETS];
+int no_counted = 0;                        /* history entries counted */
+/* Names of the built in commands, see find_builtin() */
+char const *const builtin_names[] = {
+	"j", "cd", "fg", "bg", "exit", "hash", "jobs", "kill", "wait", "bench",
+	"local", "unset", "export", "waitfor", "checkEnv", NULL
+};
+struct termios cooked;      /* terminal settings to restore after editing */
+/* Interpreter operations, indexed by OP_* */
+void (*const vm_ops[NO_OPS])() = {
+	vm_spawn, vm_test, vm_jump, vm_jump_false,
+	vm_set, vm_for_init, vm_for_next, vm_exit
+};
+
+/*------------------------------------------------------------------------------
+ * SIGNAL HANDLERS
+ */
+
+/*
+ * Handles SIGCHLD, SIGINT, SIGTSTP and SIGWINCH by recording them for
+ * sig_drain(). It only calls async-signal-safe functions and runs with all
+ * signals blocked, so it is never reentered.
+ */
+void sig_catch(int sig) {
+	int saved = errno;
+	if (sig == SIGCHLD) {
+		reap_children();
+	} else if (sig_head - sig_tail < SIG_RING) {
+		sig_push(sig, 0, 0);
+	}
+	errno = saved;
+}
+
+/*
+ * Appends a record of sig to the signal records, which must have room, and
+ * wakes the event loop. Only called with the handler kept out.
+ */
+void sig_push(int sig, pid_t pid, int status) {
+	struct sig_record *r = &sig_ring[sig_head % SIG_RING];
+	r->sig = sig;
+	r->pid = pid;
+	r->status = status;
+	clock_gettime(CLOCK_MONOTONIC, &r->at); /* async-signal-safe */
+	sig_head++;
+	sig_wake();
+}
+
+/*
+ * Reaps the children that have exited or stopped into the signal records.
+ * When the records are full the rest are left for sig_drain(), which reaps
+ * them once it has made room, so no status is lost.
+ */
+void reap_children(void) {
+	int status;
+	pid_t c_pid;
+	while (sig_head - sig_tail < SIG_RING) {
+		/* WUNTRACED: also return if a child has stopped
+		   WNOHANG: return immediately if no child has exited */
+		c_pid = waitpid(WAIT_ANY, &status, WUNTRACED | WNOHANG);
+		if (c_pid <= 0) return;
+		if (c_pid == zygote_pid) continue;
+		sig_push(SIGCHLD, c_pid, status);
+	}
+	sig_full = 1;
+}
+
+/*
+ * Wakes the event loop to drain the signal records, one byte is enough for
+ * any number of them.
+ */
+void sig_wake(void) {
+	char c = 0;
+	if (sig_pipe[WRITE_END] != -1) write(sig_pipe[WRITE_END], &c, 1);
+}
+
+/*
+ * Installs sig_catch() for sig, with all signals blocked while it runs.
+ */
+void sig_handle(int sig) {
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sig_catch;
+	sa.sa_flags = SA_RESTART;
+	sigfillset(&sa.sa_mask);
+	sigaction(sig, &sa, NULL);
+}
+
+/*
+ * Makes the pipe that wakes the event loop when signals are recorded.
+ */
+void sig_init(void) {
+	if (pipe2(sig_pipe, O_NONBLOCK | O_CLOEXEC) == -1) return;
+	if (ev_add(sig_pipe[READ_END], sig_drain, NULL) == -1) {
+		close(sig_pipe[READ_END]);
+		close(sig_pipe[WRITE_END]);
+		sig_pipe[READ_END] = sig_pipe[WRITE_END] = -1;
+	}
+}
+
+/*
+ * Acts on the recorded signals in one batch, however many there are. When
+ * polling, and when the records were full, the children are reaped here.
+ * Called from the event loop, and after each command.
+ */
+void sig_drain(void *arg) {
+	char buf[64];
+	sigset_t all, old_mask;
+	struct sig_record r;
+	if (sig_pipe[READ_END] != -1) {
+		while (read(sig_pipe[READ_END], buf, sizeof(buf)) > 0);
+	}
+	sigfillset(&all);
+	do {
+		/* The handler is the only producer, keep it out while reaping */
+		sigprocmask(SIG_BLOCK, &all, &old_mask);
+		#ifndef POLLING
+		if (sig_full)
+		#endif
+		{
+			sig_full = 0;
+			reap_children();
+		}
+		sigprocmask(SIG_SETMASK, &old_mask, NULL);
+		while (sig_tail != sig_head) {
+			r = sig_ring[sig_tail % SIG_RING];
+			sig_tail++;
+			if (r.sig == SIGCHLD) {
+				print_status(r.pid, r.status);
+				update_job(r.pid, r.status);
+			} else if (r.sig == SIGINT) {
+				fprintf(stdout, "\n[Ctrl+C]\n");
+				term_all();
+			} else if (r.sig == SIGTSTP) {
+				fprintf(stdout, "\n[Ctrl+Z]\n");
+				if (kill(shell_pid, SIGSTOP) == -1) perror("kill");
+			} else if (r.sig == SIGWINCH) {
+				term_resized = 1;
+			}
+		}
+	} while (sig_full);
+	(void)arg;
+}
+
+/*------------------------------------------------------------------------------
+ * MAIN
+ */
+
+/*
+ * Drives the program. With a script as argument the script is run instead of
+ * prompting, and its exit status becomes the exit status of the shell. With
+ * -d the shell serves tj_client as a daemon.
+ */
+int main(int argc, char **argv) {
+	init(argc, argv);
+	if (argc == 2 && strcmp(argv[1], "-d") == 0) exit(serve());
+	if (argc > 1) exit(run_args(argc - 1, argv + 1));
+	#ifdef POLLING
+	fprintf(stdout, "\nWelcome to TJ Shell! (POLLING) \n\n");
+	#else
+	fprintf(stdout, "\nWelcome to TJ Shell! (SIGDET=1) \n\n");
+	#endif
+	while (1) {
+		cgroup_reap();
+		timers_collect();
+		prompt();
+		ten_ms_sleep(10);
+		sig_drain(NULL);
+	}
+}
+
+/*------------------------------------------------------------------------------
+ * CALLED FROM MAIN
+ */
+
+/*
+ * Init. A shell running a script is not interactive, it stays in the process
+ * group it was started in and leaves the terminal and its signals alone.
+ */
+void init(int argc, char **argv) {
+	shell_pid = getpid();
+	vars_init();
+	cwd_init();
+	sig_init();
+	if (argc > 1) {
+		interactive = 0;
+		#ifndef POLLING
+		sig_handle(SIGCHLD);
+		#endif
+		/* The children of a zygote of the daemon would not be the sessions' */
+		if (strcmp(argv[1], "-d") != 0) zygote_start();
+		return;
+	}
+	/* If not already:
+	   Set PGID=PID, this makes the shell process group leader.
+	   Take control of the terminal. */
+	if (setpgid(shell_pid, shell_pid) == -1) {
+		fprintf(stderr, "init: Could not set the shell process group leader\n");
+		exit(EXIT_FAILURE);
+	}
+	sig_handle(SIGINT);               /* Ctrl+C: terminal interrupt signal */
+	signal(SIGQUIT, SIG_DFL);         /* Ctrl+4: terminal quit signal */
+	sig_handle(SIGTSTP);              /* Ctrl+Z: terminal stop signal */
+	sig_handle(SIGWINCH);             /* terminal resized */
+	signal(SIGTTIN, SIG_IGN);         /* background process attempting read */
+	signal(SIGTTOU, SIG_IGN);         /* background process attempting write */
+	#ifdef POLLING
+	signal(SIGCHLD, SIG_DFL);         /* child process terminated, stopped */
+	#else
+	sig_handle(SIGCHLD);
+	#endif
+	zygote_start();
+}
+
+/*
+ * Runs the command line args[1] if args[0] is -c, else the script args[0]
+ * with the following arguments. Returns the exit status.
+ */
+int run_args(int no_args, char **args) {
+	if (no_args == 2 && strcmp(args[0], "-c") == 0) {
+		exec_cmdline(args[1]);
+		return last_status;
+	}
+	return run_script(no_args, args);
+}
+
+/*
+ * Prompt user, get command line and excecute commands.
+ */
+void prompt(void) {
+	char const *format = var_get("PROMPT");
+	char *line;
+	if (shell_pid != getpid()) {
+		fprintf(stderr, "prompt: Permission for child denied\n");
+		_exit(EXIT_FAILURE);
+	}
+	if (format == NULL) format = PROMPT_DEFAULT;
+	if (strstr(format, "%b") != NULL) vcs_request(cwd);
+	if (isatty(STDIN_FILENO) && isatty(STDOUT_FILENO)) {
+		line = edit_line(format);
+		if (line != NULL && strlen(line) > 0) add_history(line);
+	} else {
+		fprintf(stdout, "%s", render_prompt(format));
+		line = read_line();
+	}
+	if (line == NULL) term_all();
+	if (strlen(line) > 0) exec_cmdline(line);
+	free(line);
+}
+
+/*------------------------------------------------------------------------------
+ * LINE EDITOR
+ *
+ * On a terminal lines are edited in raw mode: Left, Right, Home, End,
+ * Backspace, Delete and the Ctrl+A, E, B, F, D, K, U, W, L keys work as in
+ * Emacs, Up and Down browse the history, Ctrl+R searches it backwards for
+ * the typed text, Tab completes and Ctrl+C discards the line. Each
+ * key is answered by at most one write() of only what changed on the screen.
+ * Lines wider than the terminal scroll horizontally.
+ */
+
+/*
+ * Reads a line from stdin when it is not a terminal. Returns it allocated, or
+ * NULL at end of input.
+ */
+char *read_line(void) {
+	char *line = NULL;
+	int c, cap = 0, i;
+	for (i = 0; (c = fgetc(stdin)) != '\n'; i++) {
+		if (c == EOF && i == 0 && feof(stdin)) {
+			free(line);
+			return NULL;
+		}
+		if (c == EOF) break;
+		line = grow(line, &cap, i + 2, 1);
+		line[i] = c;
+	}
+	line = grow(line, &cap, i + 1, 1);
+	line[i] = '\0'; /* null-terminate string */
+	return line;
+}
+
+/*
+ * Edits a line after the prompt rendered from format. Returns the line
+ * allocated, or NULL at end of input.
+ */
+char *edit_line(char const *format) {
+	char c, **prompt;
+	int done = 0;
+	struct editor ed;
+	struct pollfd fds[4];
+	struct winsize ws;
+	memset(&ed, 0, sizeof(ed));
+	ed.format = format;
+	malloc_strcpy(&ed.prompt, render_prompt(format));
+	ed.buf = grow(NULL, &ed.cap, 1, 1);
+	ed.buf[0] = '\0';
+	hist_sync();
+	ed.history = hist.n;
+	ed.match = -1;
+	ed.cols = 80;
+	term_resized = 1;
+	fflush(stdout);
+	if (raw_mode(1) == -1) {
+		free(ed.prompt);
+		free(ed.buf);
+		fprintf(stdout, "%s", render_prompt(format));
+		return read_line();
+	}
+	fds[0].fd = STDIN_FILENO;
+	fds[0].events = POLLIN;
+	fds[1].events = POLLIN;
+	fds[2].events = POLLIN;
+	fds[3].events = POLLIN;
+	while (!done) {
+		/* First, and after a SIGWINCH, the line is drawn for the width */
+		if (term_resized) {
+			term_resized = 0;
+			if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+				ed.cols = ws.ws_col;
+			}
+			edit_refresh(&ed, 1);
+		}
+		/* Workers not started have -1, which poll() ignores */
+		fds[1].fd = vcs_pipe[READ_END];
+		fds[2].fd = scan_pipe[READ_END];
+		fds[3].fd = ev_epoll;
+		if (poll(fds, 4, -1) == -1) continue;
+		if (fds[1].revents & POLLIN && vcs_collect()) {
+			/* While searching the prompt comes back at the end */
+			prompt = (ed.query == NULL ? &ed.prompt : &ed.saved_prompt);
+			free(*prompt);
+			malloc_strcpy(prompt, render_prompt(format));
+			edit_refresh(&ed, 1);
+		}
+		if (fds[2].revents & POLLIN) {
+			scan_collect();
+			if (ed.pending) edit_complete(&ed);
+		}
+		/* After a SIGWINCH it is drawn at the top of the loop */
+		if (fds[3].revents & POLLIN && ev_run_once(0) && !term_resized) {
+			edit_refresh(&ed, 1);
+		}
+		if (!(fds[0].revents & (POLLIN | POLLHUP))) continue;
+		if (read(STDIN_FILENO, &c, 1) != 1) {
+			if (errno != EINTR && errno != EAGAIN) done = -1;
+			continue;
+		}
+		done = edit_key(&ed, c);
+	}
+	raw_mode(0);
+	write_all(STDOUT_FILENO, "\r\n", 2);
+	free(ed.prompt);
+	free(ed.shown);
+	free(ed.saved);
+	free(ed.query);
+	free(ed.saved_prompt);
+	if (done == -1) {
+		free(ed.buf);
+		return NULL;
+	}
+	return ed.buf;
+}
+
+/*
+ * Handles key c. Returns 1 when the line is done, -1 at end of input, else
+ * 0.
+ */
+int edit_key(struct editor *ed, int c) {
+	char seq[16];
+	struct pollfd fd;
+	int full = 0, n;
+	if (ed->query != NULL && edit_search(ed, c) == 0) return 0;
+	ed->pending = 0;
+	ed->tabs = (c == '\t' ? ed->tabs + 1 : 0);
+	switch (c) {
+	case '\r': case '\n':
+		ed->pos = ed->len;
+		edit_refresh(ed, 0);
+		return 1;
+	case CTRL_KEY('C'):
+		write_all(STDOUT_FILENO, "^C", 2);
+		ed->len = ed->pos = 0;
+		ed->buf[0] = '\0';
+		return 1;
+	case CTRL_KEY('D'):
+		if (ed->len == 0) return -1;
+		edit_delete(ed, 1);
+		break;
+	case 127: case CTRL_KEY('H'): edit_delete(ed, -1); break;
+	case CTRL_KEY('A'): ed->pos = 0; break;
+	case CTRL_KEY('E'): ed->pos = ed->len; break;
+	case CTRL_KEY('B'):
+		while (ed->pos > 0 && UTF8_CONT(ed->buf[--ed->pos]));
+		break;
+	case CTRL_KEY('F'):
+		while (ed->pos < ed->len && UTF8_CONT(ed->buf[++ed->pos]));
+		break;
+	case CTRL_KEY('K'):
+		ed->len = ed->pos;
+		ed->buf[ed->len] = '\0';
+		break;
+	case CTRL_KEY('U'):
+		memmove(ed->buf, ed->buf + ed->pos, ed->len - ed->pos + 1);
+		ed->len -= ed->pos;
+		ed->pos = 0;
+		break;
+	case CTRL_KEY('W'):
+		while (ed->pos > 0 && ed->buf[ed->pos - 1] == ' ') edit_delete(ed, -1);
+		while (ed->pos > 0 && ed->buf[ed->pos - 1] != ' ') edit_delete(ed, -1);
+		break;
+	case CTRL_KEY('L'):
+		write_all(STDOUT_FILENO, "\033[H\033[2J", 7);
+		full = 1;
+		break;
+	case CTRL_KEY('R'):
+		/* Start searching */
+		ed->saved_prompt = ed->prompt;
+		ed->prompt = NULL;
+		malloc_strcpy(&ed->query, "");
+		edit_search(ed, 0);
+		return 0;
+	case '\t':
+		edit_complete(ed);
+		return 0;
+	case CTRL_KEY('P'): edit_history(ed, -1); break;
+	case CTRL_KEY('N'): edit_history(ed, 1); break;
+	case '\033':
+		/* Escape sequence, the rest follows at once unless Esc was pressed */
+		fd.fd = STDIN_FILENO;
+		fd.events = POLLIN;
+		if (poll(&fd, 1, 50) != 1 || read(STDIN_FILENO, seq, 1) != 1 ||
+			poll(&fd, 1, 50) != 1 || read(STDIN_FILENO, seq + 1, 1) != 1) {
+			break;
+		}
+		if (seq[0] == '[' && seq[1] >= '0' && seq[1] <= '9') {
+			/* Up to the final byte, so that ESC [ 1 ; 5 C is not typed */
+			for (n = 2; n < (int)sizeof(seq) && seq[n - 1] >= ' ' &&
+				seq[n - 1] <= '?' && poll(&fd, 1, 50) == 1 &&
+				read(STDIN_FILENO, seq + n, 1) == 1; n++);
+			if (n != 3 || seq[2] != '~') break;
+			if (seq[1] == '1' || seq[1] == '7') ed->pos = 0;
+			if (seq[1] == '4' || seq[1] == '8') ed->pos = ed->len;
+			if (seq[1] == '3') edit_delete(ed, 1);
+		} else if (seq[0] == '[' || seq[0] == 'O') {
+			switch (seq[1]) {
+			case 'A': edit_history(ed, -1); break;
+			case 'B': edit_history(ed, 1); break;
+			case 'C': return edit_key(ed, CTRL_KEY('F'));
+			case 'D': return edit_key(ed, CTRL_KEY('B'));
+			case 'H': ed->pos = 0; break;
+			case 'F': ed->pos = ed->len; break;
+			}
+		}
+		break;
+	default:
+		seq[0] = c;
+		if ((unsigned char)c >= ' ') edit_insert(ed, seq, 1);
+	}
+	edit_refresh(ed, full);
+	return 0;
+}
+
+/*
+ * Inserts n bytes of s at the cursor.
+ */
+void edit_insert(struct editor *ed, char const *s, int n) {
+	ed->buf = grow(ed->buf, &ed->cap, ed->len + n + 1, 1);
+	memmove(ed->buf + ed->pos + n, ed->buf + ed->pos, ed->len - ed->pos + 1);
+	memcpy(ed->buf + ed->pos, s, n);
+	ed->len += n;
+	ed->pos += n;
+}
+
+/*
+ * Deletes the character after the cursor if dir is 1, or before it if -1.
+ */
+void edit_delete(struct editor *ed, int dir) {
+	int end, start;
+	start = end = ed->pos;
+	if (dir > 0) {
+		while (end < ed->len && UTF8_CONT(ed->buf[++end]));
+	} else {
+		while (start > 0 && UTF8_CONT(ed->buf[--start]));
+	}
+	memmove(ed->buf + start, ed->buf + end, ed->len - end + 1);
+	ed->len -= end - start;
+	ed->pos = start;
+}
+
+/*
+ * Replaces the line by s, with the cursor at the end.
+ */
+void edit_set(struct editor *ed, char const *s) {
+	ed->len = strlen(s);
+	ed->buf = grow(ed->buf, &ed->cap, ed->len + 1, 1);
+	memcpy(ed->buf, s, ed->len + 1);
+	ed->pos = ed->len;
+}
+
+/*
+ * Goes to the previous line of the history if dir is -1, or the next if 1.
+ * The line being edited is kept while browsing.
+ */
+void edit_history(struct editor *ed, int dir) {
+	int i = ed->history + dir;
+	if (i < 0 || i > hist.n) return;
+	if (ed->history == hist.n) {
+		free(ed->saved);
+		malloc_strcpy(&ed->saved, ed->buf);
+	}
+	ed->history = i;
+	edit_set(ed, i == hist.n ? ed->saved : hist_line(i));
+}
+
+/*
+ * Handles key c while searching the history, c is 0 to start. Typed text is
+ * added to the query, Backspace removes from it and Ctrl+R finds an older
+ * match. Ctrl+G cancels the search, other keys end it with the match as the
+ * line and are then handled as usual. Returns 0 if the key was handled, else
+ * -1.
+ */
+int edit_search(struct editor *ed, int c) {
+	char *prompt;
+	int len = strlen(ed->query), from = hist.n;
+	if (c == CTRL_KEY('R')) {
+		from = (ed->match == -1 ? hist.n : ed->match);
+	} else if (c == 127 || c == CTRL_KEY('H')) {
+		if (len > 0) ed->query[len - 1] = '\0';
+	} else if (c == CTRL_KEY('G')) {
+		edit_set(ed, "");
+	} else if (c == 0 || (unsigned char)c >= ' ') {
+		ed->query = realloc(ed->query, len + 2);
+		ed->query[len] = c;
+		ed->query[len + (c != 0)] = '\0';
+		/* The current match is still the newest if it has the new text */
+		if (ed->match != -1) from = ed->match + 1;
+	} else {
+		from = -1;
+	}
+	if (c == CTRL_KEY('G') || from == -1) {
+		/* End of search */
+		free(ed->prompt);
+		ed->prompt = ed->saved_prompt;
+		ed->saved_prompt = NULL;
+		free(ed->query);
+		ed->query = NULL;
+		ed->match = -1;
+		edit_refresh(ed, 1);
+		return (c == CTRL_KEY('G') ? 0 : -1);
+	}
+	if (ed->query[0] != '\0') {
+		if ((from = hist_search(ed->query, from)) != -1 || c != CTRL_KEY('R')) {
+			ed->match = from;
+		}
+		if (ed->match != -1) edit_set(ed, hist_line(ed->match));
+	}
+	prompt = malloc(strlen(ed->query) + 32);
+	sprintf(prompt, "(%sreverse-i-search)'%s': ",
+		ed->match == -1 && ed->query[0] != '\0' ? "failing " : "", ed->query);
+	free(ed->prompt);
+	ed->prompt = prompt;
+	edit_refresh(ed, 1);
+	return 0;
+}
+
+/*
+ * Updates the terminal row to show the prompt and the line. Only the part
+ * after the first difference to what is shown is written, unless full is set,
+ * and the whole update is one write().
+ */
+void edit_refresh(struct editor *ed, int full) {
+	static char *out = NULL;
+	static int out_cap = 0;
+	char *row;
+	int avail, col, diff, end, len, n, prompt_cols = columns(ed->prompt, -1);
+	/* Scroll so that the cursor is visible */
+	avail = ed->cols - 1 - prompt_cols;
+	if (avail < 8) avail = 8;
+	if (ed->pos < ed->offset) ed->offset = ed->pos;
+	while (columns(ed->buf + ed->offset, ed->pos - ed->offset) >= avail) {
+		while (UTF8_CONT(ed->buf[++ed->offset]));
+	}
+	for (end = ed->offset; end < ed->len &&
+		columns(ed->buf + ed->offset, end - ed->offset) < avail; ) {
+		while (UTF8_CONT(ed->buf[++end]));
+	}
+	/* The new row, and the column of the cursor in it */
+	len = strlen(ed->prompt) + (end - ed->offset);
+	row = malloc(len + 1);
+	sprintf(row, "%s%.*s", ed->prompt, end - ed->offset, ed->buf + ed->offset);
+	col = prompt_cols + columns(ed->buf + ed->offset, ed->pos - ed->offset);
+	/* Skip the unchanged start, but not into the middle of a character */
+	for (diff = 0; !full && diff < len && diff < ed->shown_len &&
+		row[diff] == ed->shown[diff]; diff++);
+	while (diff > 0 && diff < len && UTF8_CONT(row[diff])) diff--;
+	if (full) ed->shown_len = 0;
+	out = grow(out, &out_cap, len + 64, 1);
+	n = 0;
+	if (full) {
+		n += sprintf(out + n, "\r");
+		ed->shown_col = 0;
+	}
+	/* Move to the first difference, write from there and clear the rest */
+	if (columns(row, diff) < ed->shown_col) {
+		n += sprintf(out + n, "\033[%dD", ed->shown_col - columns(row, diff));
+	} else if (columns(row, diff) > ed->shown_col) {
+		n += sprintf(out + n, "\033[%dC", columns(row, diff) - ed->shown_col);
+	}
+	memcpy(out + n, row + diff, len - diff);
+	n += len - diff;
+	if (len < ed->shown_len || full) n += sprintf(out + n, "\033[K");
+	/* Then put the cursor in place */
+	if (columns(row, len) > col) {
+		n += sprintf(out + n, "\033[%dD", columns(row, len) - col);
+	}
+	if (n > 0) write_all(STDOUT_FILENO, out, n);
+	free(ed->shown);
+	ed->shown = row;
+	ed->shown_len = len;
+	ed->shown_col = col;
+}
+
+/*
+ * Returns the number of terminal columns of the first n bytes of s, or of all
+ * of s if n is -1. Continuation bytes of UTF-8 take no column.
+ */
+int columns(char const *s, int n) {
+	int cols = 0, i;
+	for (i = 0; (n == -1 ? s[i] != '\0' : i < n); i++) {
+		if (!UTF8_CONT(s[i])) cols++;
+	}
+	return cols;
+}
+
+/*
+ * Returns how many of the first n bytes of s fit in cols terminal columns,
+ * not cutting a UTF-8 character.
+ */
+int fit_columns(char const *s, int n, int cols) {
+	int i;
+	for (i = 0; i < n; i++) {
+		if (!UTF8_CONT(s[i]) && cols-- == 0) break;
+	}
+	return i;
+}
+
+/*
+ * Puts the terminal in raw mode if on is set, else back in the mode it had.
+ * Output processing is kept, so newlines still return the carriage. Returns
+ * 0 on success, else -1.
+ */
+int raw_mode(int on) {
+	struct termios raw;
+	if (!on) return tcsetattr(STDIN_FILENO, TCSADRAIN, &cooked);
+	if (tcgetattr(STDIN_FILENO, &cooked) == -1) return -1;
+	raw = cooked;
+	raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+	raw.c_cflag |= CS8;
+	raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+	raw.c_cc[VMIN] = 1;
+	raw.c_cc[VTIME] = 0;
+	return tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+}
+
+/*------------------------------------------------------------------------------
+ * HISTORY
+ *
+ * The history is kept in a file shared by all sessions, in records appended
+ * with O_APPEND, see struct hist_record. Each session maps the file and picks
+ * up the records of other sessions as the file grows. Reverse search goes
+ * through a trigram index: a line can only contain the query if it contains
+ * every three bytes of it, so only the entries in the shortest list of the
+ * query's trigrams that are also in the other lists are compared.
+ */
+
+/*
+ * Opens the history file, or if that fails an anonymous file so that the
+ * history still works for this session. Returns 0 on success, else -1.
+ */
+int hist_open(void) {
+	char const *file = var_get("TJ_HISTFILE"), *home = var_get("HOME");
+	char *path = NULL;
+	if (file == NULL && home != NULL) {
+		path = malloc(strlen(home) + sizeof(HIST_FILE) + 1);
+		sprintf(path, "%s/%s", home, HIST_FILE);
+		file = path;
+	}
+	if (file != NULL) {
+		hist.fd = open(file, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+	}
+	free(path);
+	if (hist.fd == -1) hist.fd = memfd_create("tj_history", MFD_CLOEXEC);
+	return (hist.fd == -1 ? -1 : 0);
+}
+
+/*
+ * Maps what was appended to the history file since the last call and adds
+ * its records as entries, to the trigram index too, so that the first search
+ * finds the index built. A record that is not complete yet is left for the
+ * next call, and bytes that are not a record are skipped.
+ */
+void hist_sync(void) {
+	char *map;
+	size_t end, size;
+	struct hist_record const *rec;
+	struct stat st;
+	if (hist.fd == -1 && hist_open() == -1) return;
+	if (fstat(hist.fd, &st) == -1 || (size_t)st.st_size == hist.map_len) return;
+	size = st.st_size;
+	if (hist.map == NULL) {
+		map = mmap(NULL, size, PROT_READ, MAP_SHARED, hist.fd, 0);
+	} else {
+		map = mremap(hist.map, hist.map_len, size, MREMAP_MAYMOVE);
+	}
+	if (map == MAP_FAILED) return;
+	hist.map = map;
+	hist.map_len = size;
+	while (hist.scanned + sizeof(*rec) <= size) {
+		rec = (struct hist_record const *)(map + hist.scanned);
+		end = hist.scanned + sizeof(*rec) + rec->len;
+		if (rec->magic != HIST_MAGIC || rec->len == 0 || rec->len > size) {
+			hist.scanned += 8;
+			continue;
+		}
+		if (end > size) break; /* still being written */
+		if (map[end - 1] != '\0') {
+			hist.scanned += 8;
+			continue;
+		}
+		hist.offsets = grow(hist.offsets, &hist.cap, hist.n + 1,
+			sizeof(size_t));
+		hist.offsets[hist.n++] = hist.scanned;
+		if (rec->seq >= hist.seq) hist.seq = rec->seq + 1;
+		hist.scanned += sizeof(*rec) + ((rec->len + 7) & ~7U);
+	}
+	hist_index();
+}
+
+/*
+ * Returns entry i of the history, valid until the next hist_sync().
+ */
+char const *hist_line(int i) {
+	return hist.map + hist.offsets[i] + sizeof(struct hist_record);
+}
+
+/*
+ * Appends a line to the history, unless it repeats the last one.
+ */
+void add_history(char const *line) {
+	char *buf;
+	size_t len = strlen(line) + 1, size;
+	struct hist_record rec;
+	hist_sync();
+	if (hist.fd == -1) return;
+	if (flock(hist.fd, LOCK_EX) == -1) {
+		perror("add_history");
+		return;
+	}
+	hist_sync(); /* the records appended before the lock was taken */
+	if (hist.n > 0 && strcmp(hist_line(hist.n - 1), line) == 0) {
+		flock(hist.fd, LOCK_UN);
+		return;
+	}
+	rec.magic = HIST_MAGIC;
+	rec.len = len;
+	rec.seq = hist.seq++;
+	rec.pid = shell_pid;
+	rec.time = time(NULL);
+	size = sizeof(rec) + ((len + 7) & ~(size_t)7);
+	buf = calloc(1, size);
+	memcpy(buf, &rec, sizeof(rec));
+	memcpy(buf + sizeof(rec), line, len);
+	if (write(hist.fd, buf, size) != (ssize_t)size) {
+		fprintf(stderr, "add_history: Could not write the history\n");
+	}
+	flock(hist.fd, LOCK_UN);
+	free(buf);
+}
+
+/*
+ * Adds the entries that are not in the trigram index yet.
+ */
+void hist_index(void) {
+	unsigned char const *line;
+	struct trigram *tri;
+	for (; hist.indexed < hist.n; hist.indexed++) {
+		line = (unsigned char const *)hist_line(hist.indexed);
+		for (; line[0] != '\0' && line[1] != '\0' && line[2] != '\0'; line++) {
+			tri = trigram_find(line[0] << 16 | line[1] << 8 | line[2], 1);
+			if (tri == NULL) return;
+			if (tri->n > 0 && tri->ids[tri->n - 1] == hist.indexed) continue;
+			tri->ids = grow(tri->ids, &tri->cap, tri->n + 1, sizeof(int));
+			tri->ids[tri->n++] = hist.indexed;
+		}
+	}
+}
+
+/*
+ * Returns the entries of trigram key. If create is set a missing trigram is
+ * added, else NULL is returned for it. NULL is also returned if the table
+ * could not grow.
+ */
+struct trigram *trigram_find(unsigned int key, int create) {
+	size_t cap, i, mask = hist.index_cap - 1;
+	struct trigram *index, *old;
+	key |= HIST_USED;
+	if (hist.index_cap > 0) {
+		for (i = (key * 2654435761U) & mask; hist.index[i].key != 0;
+			i = (i + 1) & mask) {
+			if (hist.index[i].key == key) return &hist.index[i];
+		}
+		if (!create) return NULL;
+		if (2 * (hist.index_used + 1) <= hist.index_cap) {
+			hist.index_used++;
+			hist.index[i].key = key;
+			return &hist.index[i];
+		}
+	}
+	if (!create) return NULL;
+	/* Grow the table to twice the size and insert again */
+	old = hist.index;
+	cap = hist.index_cap;
+	if (cap > ((size_t)-1 / 2) / sizeof(struct trigram) ||
+		(index = calloc(cap == 0 ? 4096 : 2 * cap,
+		sizeof(struct trigram))) == NULL) {
+		return NULL;
+	}
+	hist.index = index;
+	hist.index_cap = (cap == 0 ? 4096 : 2 * cap);
+	hist.index_used = 0;
+	for (i = 0; i < cap; i++) {
+		if (old[i].key != 0) *trigram_find(old[i].key, 1) = old[i];
+	}
+	free(old);
+	return trigram_find(key, 1);
+}
+
+/*
+ * Returns the newest entry before entry before that contains query, or -1 if
+ * none.
+ */
+int hist_search(char const *query, int before) {
+	int found, i, j, k, lo, hi, len = strlen(query), no_lists = 0;
+	unsigned char const *q = (unsigned char const *)query;
+	struct trigram **lists, *tri;
+	if (len < 3) {
+		for (i = before - 1; i >= 0; i--) {
+			if (strstr(hist_line(i), query) != NULL) return i;
+		}
+		return -1;
+	}
+	lists = malloc((len - 2) * sizeof(struct trigram *));
+	for (i = 0; i + 2 < len; i++) {
+		if ((tri = trigram_find(q[i] << 16 | q[i+1] << 8 | q[i+2], 0)) == NULL) {
+			free(lists);
+			return -1;
+		}
+		lists[no_lists++] = tri;
+		if (tri->n < lists[0]->n) {
+			lists[no_lists - 1] = lists[0];
+			lists[0] = tri;
+		}
+	}
+	/* Newest first through the shortest list, binary search the others */
+	found = -1;
+	for (i = lists[0]->n - 1; i >= 0 && found == -1; i--) {
+		if (lists[0]->ids[i] >= before) continue;
+		for (j = 1; j < no_lists; j++) {
+			for (lo = 0, hi = lists[j]->n; lo < hi; ) {
+				k = (lo + hi) / 2;
+				if (lists[j]->ids[k] < lists[0]->ids[i]) lo = k + 1;
+				else hi = k;
+			}
+			if (lo == lists[j]->n || lists[j]->ids[lo] != lists[0]->ids[i]) {
+				break;
+			}
+		}
+		if (j == no_lists && strstr(hist_line(lists[0]->ids[i]), query)) {
+			found = lists[0]->ids[i];
+		}
+	}
+	free(lists);
+	return found;
+}
+
+/*------------------------------------------------------------------------------
+ * COMPLETION
+ *
+ * The first word of a command completes from a trie of the commands in PATH
+ * and the built in commands, other words complete as file names. Directories
+ * are read by a worker thread into a cache that is kept until a directory
+ * changes. Tab waits COMPLETE_WAIT ms for a scan, after that the completion
+ * is done when the scan is, unless another key was pressed. Candidates are
+ * listed by how often they occur in the history.
+ */
+
+/*
+ * Completes the word before the cursor. One candidate is inserted, several
+ * are completed to their common start, and a second Tab lists them.
+ */
+void edit_complete(struct editor *ed) {
+	char *word, *out;
+	int cmd, common, i, n, start, skip, len;
+	struct completion comp = {NULL, 0, 0};
+	for (start = ed->pos; start > 0 && ed->buf[start - 1] != ' '; start--);
+	for (i = start; i > 0 && ed->buf[i - 1] == ' '; i--);
+	word = malloc(ed->pos - start + 1);
+	memcpy(word, ed->buf + start, ed->pos - start);
+	word[ed->pos - start] = '\0';
+	cmd = (i == 0 || ed->buf[i - 1] == '|' || ed->buf[i - 1] == '&') &&
+		strchr(word, '/') == NULL;
+	if ((cmd ? complete_command(word, &comp) : complete_file(word, &comp)) == -1) {
+		ed->pending = 1;
+		free(word);
+		return;
+	}
+	ed->pending = 0;
+	/* The common start of the candidates */
+	common = (comp.no_cands > 0 ? strlen(comp.cands[0].word) : 0);
+	for (i = 1; i < comp.no_cands; i++) {
+		for (n = 0; n < common && comp.cands[i].word[n] == comp.cands[0].word[n];
+			n++);
+		common = n;
+	}
+	len = strlen(word);
+	if (common > len) {
+		edit_insert(ed, comp.cands[0].word + len, common - len);
+		if (comp.no_cands == 1 && comp.cands[0].word[common - 1] != '/') {
+			edit_insert(ed, " ", 1);
+		}
+		edit_refresh(ed, 0);
+	} else if (comp.no_cands > 1 && ed->tabs > 1) {
+		/* List the candidates below the line, by rank */
+		qsort(comp.cands, comp.no_cands, sizeof(struct candidate),
+			compare_candidates);
+		skip = (cmd || strrchr(word, '/') == NULL ? 0 :
+			strrchr(word, '/') - word + 1);
+		out = malloc(MAX_LISTED * (NAME_MAX + 3) + 64);
+		n = sprintf(out, "\r\n");
+		for (i = 0; i < comp.no_cands && i < MAX_LISTED; i++) {
+			n += sprintf(out + n, "%s  ", comp.cands[i].word + skip);
+		}
+		if (comp.no_cands > MAX_LISTED) {
+			n += sprintf(out + n, "(%d more)", comp.no_cands - MAX_LISTED);
+		}
+		n += sprintf(out + n, "\r\n");
+		write_all(STDOUT_FILENO, out, n);
+		free(out);
+		edit_refresh(ed, 1);
+	}
+	for (i = 0; i < comp.no_cands; i++) free(comp.cands[i].word);
+	free(comp.cands);
+	free(word);
+}
+
+/*
+ * Adds the commands starting with prefix to comp. Returns 0, or -1 if the
+ * directories of PATH are not scanned yet.
+ */
+int complete_command(char const *prefix, struct completion *comp) {
+	char name[NAME_MAX + 1];
+	int len = strlen(prefix);
+	struct trie *node;
+	if (cmd_trie == NULL && build_trie() == -1) return -1;
+	if (len > NAME_MAX) return 0;
+	node = cmd_trie;
+	for (strcpy(name, prefix); *prefix != '\0'; prefix++) {
+		for (node = node->child; node != NULL && node->c != *prefix;
+			node = node->next);
+		if (node == NULL) return 0;
+	}
+	trie_collect(node, name, len, comp);
+	return 0;
+}
+
+/*
+ * Adds the files starting with word to comp, directories with a slash after.
+ * Hidden files are only added if the name starts with a dot. Returns 0, or
+ * -1 if the directory is not scanned yet.
+ */
+int complete_file(char const *word, struct completion *comp) {
+	char const *base, *home = var_get("HOME"), *slash = strrchr(word, '/');
+	char *dir, *prefix;
+	int i, len;
+	struct dir_list *list;
+	struct timeval now;
+	base = (slash == NULL ? word : slash + 1);
+	len = base - word;
+	dir = malloc(strlen(cwd) + (home == NULL ? 0 : strlen(home)) + len + 2);
+	if (slash == NULL) {
+		strcpy(dir, cwd);
+	} else if (word[0] == '/') {
+		sprintf(dir, "%.*s", len, word);
+	} else if (word[0] == '~' && word[1] == '/' && home != NULL) {
+		sprintf(dir, "%s%.*s", home, len - 1, word + 1);
+	} else {
+		sprintf(dir, "%s/%.*s", cwd, len, word);
+	}
+	gettimeofday(&now, NULL);
+	list = dir_scan(dir, now.tv_sec * 1000L + now.tv_usec / 1000 + COMPLETE_WAIT);
+	free(dir);
+	if (list == NULL) return -1;
+	prefix = malloc(len + 1);
+	sprintf(prefix, "%.*s", len, word);
+	for (i = 0; i < list->no_names; i++) {
+		if (strncmp(list->names[i], base, strlen(base)) != 0) continue;
+		if (list->names[i][0] == '.' && base[0] != '.') continue;
+		add_candidate(comp, prefix, list->names[i],
+			list->types[i] == 'd' ? "/" : "");
+	}
+	free(prefix);
+	return 0;
+}
+
+/*
+ * Adds the word made of a, b and c to comp.
+ */
+void add_candidate(struct completion *comp, char const *a, char const *b,
+	char const *c) {
+	struct candidate *cand;
+	comp->cands = grow(comp->cands, &comp->cap, comp->no_cands + 1,
+		sizeof(struct candidate));
+	cand = &comp->cands[comp->no_cands++];
+	cand->word = malloc(strlen(a) + strlen(b) + strlen(c) + 1);
+	sprintf(cand->word, "%s%s%s", a, b, c);
+	cand->rank = word_rank(cand->word);
+}
+
+/*
+ * Orders candidates by rank, then by name.
+ */
+int compare_candidates(void const *a, void const *b) {
+	struct candidate const *x = a, *y = b;
+	if (x->rank != y->rank) return (x->rank > y->rank ? -1 : 1);
+	return strcmp(x->word, y->word);
+}
+
+/*
+ * Builds the command trie from the directories of PATH. Returns 0, or -1 if
+ * they could not all be scanned within COMPLETE_WAIT ms.
+ */
+int build_trie(void) {
+	char const *end, *path = var_get("PATH"), *p;
+	char *dir;
+	int i, pass;
+	long deadline;
+	struct dir_list *list;
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	deadline = now.tv_sec * 1000L + now.tv_usec / 1000 + COMPLETE_WAIT;
+	/* Ask for all directories, wait for them and then add the commands */
+	for (pass = 0; pass < 3; pass++) {
+		if (pass == 2) {
+			cmd_trie = calloc(1, sizeof(struct trie));
+			for (i = 0; builtin_names[i] != NULL; i++) trie_add(builtin_names[i]);
+		}
+		for (p = path; p != NULL; p = (*end == '\0' ? NULL : end + 1)) {
+			end = p + strcspn(p, ":");
+			dir = malloc(strlen(cwd) + (end - p) + 2);
+			if (*p == '/') {
+				sprintf(dir, "%.*s", (int)(end - p), p);
+			} else {
+				sprintf(dir, "%s/%.*s", cwd, (int)(end - p), p);
+			}
+			list = dir_scan(dir, pass == 0 ? 0 : deadline);
+			free(dir);
+			if (pass > 0 && list == NULL) {
+				/* A partial trie would keep the next Tab from trying again */
+				trie_free(cmd_trie);
+				cmd_trie = NULL;
+				return -1;
+			}
+			for (i = 0; pass == 2 && i < list->no_names; i++) {
+				if (list->types[i] == 'x') trie_add(list->names[i]);
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Adds command name to the trie.
+ */
+void trie_add(char const *name) {
+	struct trie *node = cmd_trie, **link;
+	for (; *name != '\0'; name++) {
+		for (link = &node->child; *link != NULL && (*link)->c != *name;
+			link = &(*link)->next);
+		if (*link == NULL) {
+			*link = calloc(1, sizeof(struct trie));
+			(*link)->c = *name;
+		}
+		node = *link;
+	}
+	node->end = 1;
+}
+
+/*
+ * Adds the commands at and below node to comp. The first len bytes of name
+ * are the path to node.
+ */
+void trie_collect(struct trie const *node, char *name, int len,
+	struct completion *comp) {
+	if (node->end) {
+		name[len] = '\0';
+		add_candidate(comp, name, "", "");
+	}
+	if (len == NAME_MAX) return;
+	for (node = node->child; node != NULL; node = node->next) {
+		name[len] = node->c;
+		trie_collect(node, name, len + 1, comp);
+	}
+}
+
+/*
+ * Frees a trie.
+ */
+void trie_free(struct trie *node) {
+	struct trie *next;
+	for (; node != NULL; node = next) {
+		next = node->next;
+		trie_free(node->child);
+		free(node);
+	}
+}
+
+/*
+ * Returns the cached names in directory path. If the directory changed since
+ * it was scanned it is scanned again, and the shell waits for the scan until
+ * deadline, in ms since the epoch. Returns NULL if the directory was never
+ * scanned before the deadline.
+ */
+struct dir_list *dir_scan(char const *path, long deadline) {
+	long left;
+	struct dir_list *list = dir_lookup(path), *req;
+	struct pollfd fd;
+	struct stat st;
+	struct timeval now;
+	if (stat(path, &st) == -1) st.st_mtim.tv_sec = st.st_mtim.tv_nsec = 0;
+	if (!list->scanning && (list->names == NULL ||
+		list->mtime_sec != st.st_mtim.tv_sec ||
+		list->mtime_nsec != st.st_mtim.tv_nsec)) {
+		if (scan_pipe[READ_END] == -1 &&
+			start_worker(scan_worker, scan_pipe) == -1) {
+			return list->names == NULL ? NULL : list;
+		}
+		req = calloc(1, sizeof(struct dir_list));
+		malloc_strcpy(&req->path, path);
+		pthread_mutex_lock(&scan_lock);
+		req->next = scan_todo;
+		scan_todo = req;
+		pthread_cond_signal(&scan_cond);
+		pthread_mutex_unlock(&scan_lock);
+		list->scanning = 1;
+	}
+	fd.fd = scan_pipe[READ_END];
+	fd.events = POLLIN;
+	while (list->scanning) {
+		gettimeofday(&now, NULL);
+		left = deadline - (now.tv_sec * 1000L + now.tv_usec / 1000);
+		if (left <= 0 || poll(&fd, 1, left) <= 0) break;
+		scan_collect();
+	}
+	return list->names == NULL ? NULL : list;
+}
+
+/*
+ * Returns the cache entry of directory path, added if missing.
+ */
+struct dir_list *dir_lookup(char const *path) {
+	struct dir_list **bucket, *list;
+	bucket = &dir_cache[fnv1a(path, strlen(path), 0) & (VAR_BUCKETS - 1)];
+	for (list = *bucket; list != NULL; list = list->next) {
+		if (strcmp(list->path, path) == 0) return list;
+	}
+	list = calloc(1, sizeof(struct dir_list));
+	malloc_strcpy(&list->path, path);
+	list->next = *bucket;
+	*bucket = list;
+	return list;
+}
+
+/*
+ * Moves the answers of the scan worker to the cache.
+ */
+void scan_collect(void) {
+	char c;
+	struct dir_list *done, *list;
+	while (read(scan_pipe[READ_END], &c, 1) == 1);
+	pthread_mutex_lock(&scan_lock);
+	done = scan_done;
+	scan_done = NULL;
+	pthread_mutex_unlock(&scan_lock);
+	for (; done != NULL; done = list) {
+		list = dir_lookup(done->path);
+		free_strs(list->names);
+		free(list->names);
+		free(list->types);
+		list->names = done->names;
+		list->types = done->types;
+		list->no_names = done->no_names;
+		list->mtime_sec = done->mtime_sec;
+		list->mtime_nsec = done->mtime_nsec;
+		list->scanning = 0;
+		list = done->next;
+		free(done->path);
+		free(done);
+	}
+}
+
+/*
+ * The scan worker thread, scans the directories asked for.
+ */
+void *scan_worker(void *arg) {
+	struct dir_list *req;
+	while (1) {
+		pthread_mutex_lock(&scan_lock);
+		while (scan_todo == NULL) pthread_cond_wait(&scan_cond, &scan_lock);
+		req = scan_todo;
+		scan_todo = req->next;
+		pthread_mutex_unlock(&scan_lock);
+		scan_dir(req);
+		pthread_mutex_lock(&scan_lock);
+		req->next = scan_done;
+		scan_done = req;
+		pthread_mutex_unlock(&scan_lock);
+		if (write(scan_pipe[WRITE_END], "", 1) == -1) perror("write");
+	}
+	return arg;
+}
+
+/*
+ * Reads the names in directory list->path into list. The modification time
+ * is taken first, so that a change during the scan is seen later.
+ */
+void scan_dir(struct dir_list *list) {
+	int cap = 0, fd, i;
+	DIR *dir;
+	struct dirent *entry;
+	struct stat st;
+	list->names = grow(NULL, &cap, 1, sizeof(char *));
+	list->names[0] = NULL;
+	list->types = NULL;
+	list->no_names = 0;
+	if ((dir = opendir(list->path)) == NULL) return;
+	fd = dirfd(dir);
+	if (fstat(fd, &st) == 0) {
+		list->mtime_sec = st.st_mtim.tv_sec;
+		list->mtime_nsec = st.st_mtim.tv_nsec;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+			continue;
+		}
+		list->names = grow(list->names, &cap, list->no_names + 2, sizeof(char *));
+		malloc_strcpy(&list->names[list->no_names++], entry->d_name);
+	}
+	list->names[list->no_names] = NULL;
+	list->types = malloc(list->no_names + 1);
+	for (i = 0; i < list->no_names; i++) {
+		if (fstatat(fd, list->names[i], &st, 0) == 0 && S_ISDIR(st.st_mode)) {
+			list->types[i] = 'd';
+		} else if (faccessat(fd, list->names[i], X_OK, 0) == 0) {
+			list->types[i] = 'x';
+		} else {
+			list->types[i] = 'f';
+		}
+	}
+	closedir(dir);
+}
+
+/*
+ * Returns how many times word occurs in the history, a slash at the end not
+ * counted. Entries added since the last call are counted first.
+ */
+int word_rank(char const *word) {
+	char const *line;
+	int len, n;
+	struct word_count **bucket, *count;
+	for (; no_counted < hist.n; no_counted++) {
+		for (line = hist_line(no_counted); *line != '\0'; line += len) {
+			line += strspn(line, " |&");
+			if ((len = strcspn(line, " |&")) == 0) break;
+			n = len - (line[len - 1] == '/');
+			bucket = &word_counts[fnv1a(line, n, 0) & (VAR_BUCKETS - 1)];
+			for (count = *bucket; count != NULL; count = count->next) {
+				if (strncmp(count->word, line, n) == 0 && count->word[n] == '\0') {
+					break;
+				}
+			}
+			if (count == NULL) {
+				count = calloc(1, sizeof(struct word_count));
+				count->word = malloc(n + 1);
+				sprintf(count->word, "%.*s", n, line);
+				count->next = *bucket;
+				*bucket = count;
+			}
+			count->n++;
+		}
+	}
+	n = strlen(word);
+	if (n > 0 && word[n - 1] == '/') n--;
+	bucket = &word_counts[fnv1a(word, n, 0) & (VAR_BUCKETS - 1)];
+	for (count = *bucket; count != NULL; count = count->next) {
+		if (strncmp(count->word, word, n) == 0 && count->word[n] == '\0') {
+			return count->n;
+		}
+	}
+	return 0;
+}
+
+/*------------------------------------------------------------------------------
+ * PROMPT
+ *
+ * The prompt is set by PROMPT, where these segments are replaced:
+ *
+ *   %d  working directory    %s  exit status of the last command
+ *   %t  its run time in ms   %j  number of jobs
+ *   %b  VCS branch, as " (branch)" if there is one
+ *   %%  a percent sign
+ *
+ * Finding the branch may be slow on network file systems, so it is done by a
+ * worker thread while the prompt is shown with the last branch found for the
+ * directory.
+ */
+
+/*
+ * Returns the prompt rendered from format, valid until the next call.
+ */
+char const *render_prompt(char const *format) {
+	static char *text = NULL;
+	static int cap = 0;
+	char num[32];
+	char const *seg;
+	int len = 0, n;
+	struct var *branch;
+	for (; *format != '\0'; format++) {
+		seg = num;
+		if (*format != '%' || format[1] == '\0') {
+			sprintf(num, "%c", *format);
+		} else {
+			switch (*++format) {
+			case 'd': seg = cwd; break;
+			case 's': sprintf(num, "%d", last_status); break;
+			case 't': sprintf(num, "%ld", last_runtime); break;
+			case 'j': sprintf(num, "%d", no_jobs); break;
+			case 'b':
+				branch = var_lookup(vcs_cache, cwd, 0);
+				seg = (branch == NULL ? "" : branch->value);
+				break;
+			default: sprintf(num, "%c", *format);
+			}
+		}
+		n = strlen(seg);
+		text = grow(text, &cap, len + n + 1, 1);
+		memcpy(text + len, seg, n);
+		len += n;
+	}
+	text = grow(text, &cap, len + 1, 1);
+	text[len] = '\0';
+	return text;
+}
+
+/*
+ * Asks the worker for the branch of dir, starting the worker if needed. If
+ * dir has never been seen, waits up to PROMPT_WAIT ms for the answer.
+ */
+void vcs_request(char const *dir) {
+	struct pollfd fd;
+	if (vcs_pipe[READ_END] == -1 && start_worker(vcs_worker, vcs_pipe) == -1) {
+		return;
+	}
+	pthread_mutex_lock(&vcs_lock);
+	free(vcs_dir);
+	malloc_strcpy(&vcs_dir, dir);
+	pthread_cond_signal(&vcs_cond);
+	pthread_mutex_unlock(&vcs_lock);
+	if (var_lookup(vcs_cache, dir, 0) == NULL) {
+		fd.fd = vcs_pipe[READ_END];
+		fd.events = POLLIN;
+		if (poll(&fd, 1, PROMPT_WAIT) > 0) vcs_collect();
+	}
+}
+
+/*
+ * Moves an answer of the worker to the cache. Returns 1 if the branch of the
+ * working directory changed, else 0.
+ */
+int vcs_collect(void) {
+	char c;
+	int changed = 0;
+	struct var *entry;
+	while (read(vcs_pipe[READ_END], &c, 1) == 1);
+	pthread_mutex_lock(&vcs_lock);
+	if (vcs_done_dir != NULL) {
+		entry = var_lookup(vcs_cache, vcs_done_dir, 1);
+		if (entry->value == NULL || strcmp(entry->value, vcs_branch_of) != 0) {
+			changed = (strcmp(vcs_done_dir, cwd) == 0);
+			free(entry->value);
+			entry->value = vcs_branch_of;
+		} else {
+			free(vcs_branch_of);
+		}
+		free(vcs_done_dir);
+		vcs_done_dir = vcs_branch_of = NULL;
+	}
+	pthread_mutex_unlock(&vcs_lock);
+	return changed;
+}
+
+/*
+ * The worker thread, finds the branch of each directory asked for. Only the
+ * last directory asked for is looked at.
+ */
+void *vcs_worker(void *arg) {
+	char *branch, *dir;
+	while (1) {
+		pthread_mutex_lock(&vcs_lock);
+		while (vcs_dir == NULL) pthread_cond_wait(&vcs_cond, &vcs_lock);
+		dir = vcs_dir;
+		vcs_dir = NULL;
+		pthread_mutex_unlock(&vcs_lock);
+		branch = vcs_branch(dir);
+		pthread_mutex_lock(&vcs_lock);
+		free(vcs_done_dir);
+		free(vcs_branch_of);
+		vcs_done_dir = dir;
+		vcs_branch_of = branch;
+		pthread_mutex_unlock(&vcs_lock);
+		if (write(vcs_pipe[WRITE_END], "", 1) == -1) perror("write");
+	}
+	return arg;
+}
+
+/*
+ * Returns the git branch of dir as an allocated " (branch)", the short
+ * commit if detached, or "" if dir is not in a repository. The repository is
+ * found by looking for .git in dir and its parents, and HEAD is read directly
+ * instead of running git.
+ */
+char *vcs_branch(char const *dir) {
+	char *branch, head[256], *path = malloc(strlen(dir) + 300), *p;
+	FILE *fp = NULL;
+	size_t len;
+	strcpy(path, dir);
+	for (len = strlen(path); fp == NULL; ) {
+		sprintf(path + len, "/.git/HEAD");
+		if ((fp = fopen(path, "r")) != NULL) break;
+		/* A worktree or submodule has a .git file naming the directory */
+		sprintf(path + len, "/.git");
+		if ((fp = fopen(path, "r")) != NULL) {
+			if (fscanf(fp, "gitdir: %255s", head) == 1) {
+				fclose(fp);
+				p = (head[0] == '/' ? path : path + len + 1);
+				sprintf(p, "%s/HEAD", head);
+				fp = fopen(path, "r");
+			} else {
+				fclose(fp);
+				fp = NULL;
+			}
+			break;
+		}
+		while (len > 0 && path[--len] != '/');
+		if (len == 0) break;
+	}
+	free(path);
+	malloc_strcpy(&branch, "");
+	if (fp == NULL) return branch;
+	if (fgets(head, sizeof(head), fp) != NULL) {
+		head[strcspn(head, "\n")] = '\0';
+		if (strncmp(head, "ref: refs/heads/", 16) == 0) {
+			p = head + 16;
+		} else {
+			p = head;
+			p[7] = '\0';
+		}
+		branch = realloc(branch, strlen(p) + 4);
+		sprintf(branch, " (%s)", p);
+	}
+	fclose(fp);
+	return branch;
+}
+
+/*------------------------------------------------------------------------------
+ * WORKING DIRECTORY
+ *
+ * The shell keeps its own logical working directory, so the prompt needs no
+ * getcwd(). A descriptor of the directory is kept to notice lazily, when a
+ * path is resolved against it, that it was moved or removed.
+ */
+
+/*
+ * Sets the working directory from PWD if it names the current directory, as
+ * it does when it was reached through symbolic links, else from getcwd().
+ */
+void cwd_init(void) {
+	char const *pwd = var_get("PWD");
+	char *path = NULL;
+	struct stat dot, st;
+	if (pwd != NULL && pwd[0] == '/' && stat(pwd, &st) == 0 &&
+		stat(".", &dot) == 0 && st.st_dev == dot.st_dev &&
+		st.st_ino == dot.st_ino) {
+		malloc_strcpy(&path, pwd);
+	} else if ((path = getcwd(NULL, 0)) == NULL) {
+		malloc_strcpy(&path, "/");
+	}
+	set_cwd(path);
+}
+
+/*
+ * Makes path, an allocated string, the working directory of the shell which
+ * the process already is in. PWD and OLDPWD are updated.
+ */
+void set_cwd(char *path) {
+	if (cwd != NULL) var_set("OLDPWD", cwd, -1);
+	var_set("PWD", path, -1);
+	free(cwd);
+	cwd = path;
+	if (cwd_fd != -1) close(cwd_fd);
+	cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+}
+
+/*
+ * Returns the working directory, after checking that it still names the
+ * directory the shell is in.
+ */
+char const *get_cwd(void) {
+	struct stat at, st;
+	if (cwd_fd == -1 || fstat(cwd_fd, &at) == -1 || stat(cwd, &st) == -1 ||
+		at.st_dev != st.st_dev || at.st_ino != st.st_ino) {
+		cwd_init();
+	}
+	return cwd;
+}
+
+/*
+ * Returns path made absolute against dir, with "." and ".." resolved without
+ * following symbolic links and without repeated slashes, as an allocated
+ * string.
+ */
+char *logical_path(char const *dir, char const *path) {
+	char *out = malloc(strlen(dir) + strlen(path) + 3);
+	char const *p, *end;
+	size_t len = 0, n;
+	sprintf(out, "%s/%s", dir, path);
+	for (p = out; *p != '\0'; p = end) {
+		while (*p == '/') p++;
+		end = p + strcspn(p, "/");
+		n = end - p;
+		if (n == 0 || (n == 1 && p[0] == '.')) continue;
+		if (n == 2 && p[0] == '.' && p[1] == '.') {
+			while (len > 0 && out[--len] != '/');
+			continue;
+		}
+		/* The component is copied left, over what was resolved away */
+		out[len++] = '/';
+		memmove(out + len, p, n);
+		len += n;
+	}
+	if (len == 0) out[len++] = '/';
+	out[len] = '\0';
+	return out;
+}
+
+/*------------------------------------------------------------------------------
+ * EXECUTE COMMANDS
+ */
+
+/*
+ * Takes an unformatted command line and excecutes it. The function compiles
+ * the line to a pipeline and runs it with exec_pipeline(). If any foreground
+ * child fail return a number representing the command that failed there 1
+ * represents the first, 2 the second etc., otherwize return 0.
+ */
+int exec_cmdline(char const *line) {
+	struct program prog;
+	int failed_cmd, p;
+	memset(&prog, 0, sizeof(prog));
+	if ((p = compile_pipeline(&prog, line)) < 0) {
+		fprintf(stderr, "exec_cmdline: Empty command\n");
+		failed_cmd = -p;
+	} else {
+		failed_cmd = exec_pipeline(&prog, p);
+	}
+	free_program(&prog);
+	return failed_cmd;
+}
+
+/*
+ * Excecutes the pipeline at offset p in the pool of a compiled program, the
+ * arguments marked for expansion are expanded first. Returns the number of
+ * the command that failed, or 0, like exec_cmdline().
+ */
+int exec_pipeline(struct program const *prog, int p) {
+	char *args[MAX_CMDS][MAX_ARGS+1], *expanded[MAX_CMDS][MAX_ARGS+1];
+	char s[STR_LEN+1];
+	int const *pool = prog->pool + p;
+	int cmd, failed_cmd = 0, i, len, literal, no_args[MAX_CMDS];
+	int no_cmds = *pool++, prefix_len = 0;
+	struct resolved fresh, **kept = NULL, *outer = resolved_cmds;
+	/* Expand the arguments of all commands first */
+	for (cmd = 0; cmd < no_cmds; cmd++) {
+		no_args[cmd] = *pool++;
+		for (i = 0; i < no_args[cmd]; i++, pool++) {
+			args[cmd][i] = prog->strs + (*pool >> 1);
+			expanded[cmd][i] = NULL;
+			if (*pool & 1) {
+				args[cmd][i] = expanded[cmd][i] = expand_word(args[cmd][i]);
+			}
+		}
+		args[cmd][no_args[cmd]] = NULL;
+	}
+	/* A script takes the prefixes and resolves the commands of a pipeline
+	   once, if they are all literal and no command name is a path */
+	if (prog->resolved != NULL) kept = &prog->resolved[p];
+	if (kept != NULL && *kept != NULL) {
+		resolved_cmds = *kept;
+		job = resolved_cmds->job;
+		prefix_len = resolved_cmds->prefix_len;
+	} else {
+		memset(&job, 0, sizeof(job));
+		job.pin = -1;
+		job.policy = job.ioprio = job.cgroup = job.watch_fd = -1;
+		while ((len = job_prefix((char const **)args[0] + prefix_len,
+			no_args[0] - prefix_len)) > 0) {
+			prefix_len += len;
+		}
+		if (len == -1) {
+			last_status = EXIT_FAILURE;
+			failed_cmd = 1;
+		}
+		literal = (len == 0 && job.watch_fd == -1);
+		for (i = 0; i < prefix_len && literal; i++) {
+			literal = (expanded[0][i] == NULL);
+		}
+		for (cmd = 0; cmd < no_cmds && literal; cmd++) {
+			literal = (expanded[cmd][cmd == 0 ? prefix_len : 0] == NULL &&
+				strchr(args[cmd][cmd == 0 ? prefix_len : 0], '/') == NULL);
+		}
+		resolved_cmds = &fresh;
+		if (kept != NULL && literal) {
+			resolved_cmds = *kept = calloc(1, sizeof(**kept));
+			resolved_cmds->job = job;
+			resolved_cmds->prefix_len = prefix_len;
+		}
+		resolved_cmds->gen = 0;
+	}
+	for (i = 0; i < prefix_len; i++) free(expanded[0][i]);
+	no_args[0] -= prefix_len;
+	memmove(args[0], args[0] + prefix_len, (no_args[0] + 1) * sizeof(char *));
+	memmove(expanded[0], expanded[0] + prefix_len, no_args[0] * sizeof(char *));
+	/* The stages are pinned by default if TJ_PIN is 1 */
+	if (job.pin == -1) {
+		job.pin = (var_get("TJ_PIN") != NULL &&
+			strcmp(var_get("TJ_PIN"), "1") == 0);
+	}
+	if (resolved_cmds->gen != cmd_gen) {
+		resolve_cmds(resolved_cmds, args, no_cmds);
+	}
+	/* Commands that are not found, or are not executable files, fail before
+	   anything is spawned */
+	for (cmd = 0; cmd < no_cmds && !failed_cmd; cmd++) {
+		if (no_cmds == 1 && no_args[0] == 1 && strchr(args[0][0], '=')) break;
+		if (resolved_cmds->builtins[cmd] == NULL &&
+			resolved_cmds->paths[cmd] == NULL) {
+			exec_failed(args[cmd][0], resolved_cmds->errs[cmd]);
+			failed_cmd = cmd + 1;
+		}
+	}
+	if (!failed_cmd) {
+		if (job.every_ms > 0) {
+			failed_cmd = run_every(args, no_args, no_cmds);
+		} else if (job.watch_fd != -1) {
+			failed_cmd = run_onchange(args, no_args, no_cmds);
+		} else {
+			failed_cmd = exec_job(args, no_args, no_cmds);
+		}
+	}
+	if (job.watch_fd != -1) close(job.watch_fd);
+	for (i = 0; i < job.no_watches; i++) free(job.watches[i].path);
+	free(job.watches);
+	if (failed_cmd && last_status == 0) last_status = EXIT_FAILURE;
+	if (failed_cmd && interactive) {
+		for (i = len = 0; i < no_args[failed_cmd-1] && len < STR_LEN; i++) {
+			len += snprintf(s + len, STR_LEN + 1 - len, "%s%s",
+				i == 0 ? "" : " ", args[failed_cmd-1][i]);
+		}
+		fprintf(stderr, "exec_pipeline: Command '%s' failed\n", s);
+	}
+	for (cmd = 0; cmd < no_cmds; cmd++) {
+		for (i = 0; i < no_args[cmd]; i++) free(expanded[cmd][i]);
+	}
+	resolved_cmds = outer; /* of a pipeline whose built in ran this one */
+	return failed_cmd;
+}
+
+/*
+ * Resolves the commands of the expanded pipeline args of no_cmds commands
+ * into res, see struct resolved.
+ */
+void resolve_cmds(struct resolved *res, char *(*args)[MAX_ARGS+1],
+	int no_cmds) {
+	int cmd;
+	for (cmd = 0; cmd < no_cmds; cmd++) {
+		res->paths[cmd] = NULL;
+		res->errs[cmd] = 0;
+		if ((res->builtins[cmd] = find_builtin(args[cmd][0])) == NULL) {
+			res->paths[cmd] = find_command(args[cmd][0], &res->errs[cmd]);
+		}
+	}
+	res->gen = cmd_gen;
+}
+
+/*
+ * Runs the expanded pipeline args of no_cmds commands as a job, with the
+ * options in job. Returns the number of the command that failed, or 0, like
+ * exec_pipeline().
+ */
+int exec_job(char *(*args)[MAX_ARGS+1], int const *no_args, int no_cmds) {
+	int cmd, failed_cmd = 0, i, len;
+	job_pgid = 0;
+	/* The pipeline as typed, for jobs */
+	for (cmd = len = 0; cmd < no_cmds; cmd++) {
+		for (i = 0; i < no_args[cmd] && len < JOB_CMD; i++) {
+			len += snprintf(job.cmd + len, JOB_CMD + 1 - len, "%s%s",
+				i > 0 ? " " : (cmd > 0 ? " | " : ""), args[cmd][i]);
+		}
+	}
+	job.cgroup = cgroup_create();
+	/* Also without a timeout onchange needs the processes, to cancel them */
+	job_timer = (job.timeout_ms > 0 || job.watch_fd != -1 ?
+		timer_start(job.timeout_ms) : NULL);
+	/* Spawn all at once, or execute commands one by one */
+	if (no_cmds == 1 || (failed_cmd = spawn_pipeline(args, no_cmds)) == -1) {
+		for (cmd = 1, failed_cmd = 0; cmd <= no_cmds && !failed_cmd; cmd++) {
+			if (exec_cmd(args[cmd-1], no_args[cmd-1], cmd, no_cmds) == -1) {
+				failed_cmd = cmd;
+			}
+		}
+	}
+	if (job.cgroup != -1) close(job.cgroup);
+	job.cgroup = -1;
+	cgroup_reap();
+	/* A background job keeps its timer */
+	if (job_timer != NULL) {
+		if (job_timer->fired && !job_timer->cancelled) last_status = TIMED_OUT;
+		job_timer->held = 0;
+		job_timer = NULL;
+	}
+	return failed_cmd;
+}
+
+/*
+ * Takes a tokenized command, check for built in command and decides execution.
+ * If foreground execution failed return -1, else 0.
+ *
+ * dtype const **var ⇒ var mutable, *var mutable, **var const
+ * (var is a: pointer to pointer to const-dtype)
+ */
+int exec_cmd(char const **args, int no_args, int cmd, int no_cmds) {
+	int background = 0;
+	builtin_fn builtin;
+	if (no_cmds == 1) {
+		/* NAME=value */
+		if (no_args == 1 && var_assign(args[0], -1) == 0) {
+			last_status = 0;
+			return 0;
+		}
+		/* Built in commands run in the shell unless piped */
+		if ((builtin = resolved_cmds->builtins[0]) != NULL) {
+			last_status = builtin(no_args, args);
+			return (last_status == EXIT_FAILURE ? -1 : 0);
+		}
+		/* If background mode */
+		if (strcmp(args[no_args-1], "&") == 0) {
+			if (no_args >= 2) {
+				args[no_args-1] = NULL; /* replace "&" with NULL */
+				background = 1;
+				/* With TJ_BGBATCH=1 it is batch scheduled with idle I/O */
+				if (var_get("TJ_BGBATCH") != NULL &&
+					strcmp(var_get("TJ_BGBATCH"), "1") == 0) {
+					if (job.policy == -1) job.policy = SCHED_BATCH;
+					if (job.ioprio == -1) job.ioprio = IOPRIO_IDLE;
+				}
+			} else {
+				return -1;
+			}
+		}
+	}
+	/* All other commands: Fork-Exec-Wait (piping in background not allowed) */
+	return fork_exec_wait(args, cmd, no_cmds, background);
+}
+
+/*
+ * Runs a pipeline of no_cmds commands, none of them built in. All pipes are
+ * made first and the stages are spawned together by the spawner threads, so
+ * that a long pipeline starts about as fast as one command. The stages share
+ * the process group of the first one. Returns the number of the command that
+ * failed, or 0, like exec_pipeline(), or -1 if the pipeline could not be
+ * spawned this way and has to be run stage by stage. That is also the case
+ * for a job with scheduling options or limits, which posix_spawn() cannot
+ * all set.
+ */
+int spawn_pipeline(char *(*args)[MAX_ARGS+1], int no_cmds) {
+	int cmd, failed_cmd = 0, pipe_fds[MAX_CMDS][2], status;
+	char *const *env = get_envp();
+	sigset_t chld, old_mask;
+	struct stage stages[MAX_CMDS];
+	struct timeval t0;
+	if (!job_plain()) return -1;
+	for (cmd = 0; cmd < no_cmds; cmd++) {
+		if (resolved_cmds->paths[cmd] == NULL) return -1;
+	}
+	while (no_spawners < SPAWNERS) {
+		if (start_worker(spawn_worker, NULL) == -1) break;
+		no_spawners++;
+	}
+	if (no_spawners == 0) return -1;
+	for (cmd = 0; cmd < no_cmds - 1; cmd++) {
+		if (pipe2(pipe_fds[cmd], O_CLOEXEC) == -1) {
+			while (cmd-- > 0) {
+				close(pipe_fds[cmd][READ_END]);
+				close(pipe_fds[cmd][WRITE_END]);
+			}
+			return -1;
+		}
+	}
+	for (cmd = 0; cmd < no_cmds; cmd++) {
+		stages[cmd].cmd = cmd + 1;
+		stages[cmd].path = resolved_cmds->paths[cmd];
+		stages[cmd].args = args[cmd];
+		stages[cmd].env = env;
+		stages[cmd].in = (cmd == 0 ? STDIN_FILENO : pipe_fds[cmd - 1][READ_END]);
+		stages[cmd].out = (cmd == no_cmds - 1 ? STDOUT_FILENO :
+			pipe_fds[cmd][WRITE_END]);
+		stages[cmd].cpu = stage_cpu(cmd + 1);
+	}
+	/* Keep the SIGCHLD handler from reaping the last stage before c_wait */
+	sigemptyset(&chld);
+	sigaddset(&chld, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &chld, &old_mask);
+	gettimeofday(&t0, NULL);
+	fflush(stdout);
+	pthread_mutex_lock(&spawn_lock);
+	spawn_stages = stages;
+	spawn_next = spawn_done = 0;
+	spawn_total = no_cmds;
+	spawn_pgid = 0;
+	spawn_failed = 0;
+	pthread_cond_broadcast(&spawn_cond);
+	while (spawn_done < no_cmds) pthread_cond_wait(&spawn_cond, &spawn_lock);
+	spawn_total = 0;
+	pthread_mutex_unlock(&spawn_lock);
+	for (cmd = 0; cmd < no_cmds - 1; cmd++) {
+		close(pipe_fds[cmd][READ_END]);
+		close(pipe_fds[cmd][WRITE_END]);
+	}
+	for (cmd = 0; cmd < no_cmds && !failed_cmd; cmd++) {
+		if (stages[cmd].err != 0) failed_cmd = cmd + 1;
+	}
+	if (failed_cmd) {
+		/* Stages spawned before the failure was known are killed */
+		for (cmd = 0; cmd < no_cmds; cmd++) {
+			if (stages[cmd].pid == -1) continue;
+			kill(stages[cmd].pid, SIGKILL);
+			waitpid(stages[cmd].pid, NULL, 0);
+		}
+		exec_failed(stages[failed_cmd - 1].args[0], stages[failed_cmd - 1].err);
+	}
+	for (cmd = 0; cmd < no_cmds && !failed_cmd && interactive; cmd++) {
+		fprintf(stdout, "[%d] Spawned in %s\n", stages[cmd].pid,
+			cmd == no_cmds - 1 ? "foreground" : "background");
+	}
+	if (failed_cmd) {
+		if (interactive && isatty(STDIN_FILENO)) {
+			tcsetpgrp(STDIN_FILENO, getpgid(shell_pid));
+		}
+	} else {
+		job_pgid = stages[0].pid;
+		for (cmd = 0; cmd < no_cmds; cmd++) {
+			timer_add(job_timer, stages[cmd].pid, stages[0].pid);
+		}
+		last_status = EXIT_FAILURE;
+		status = c_wait(stages[no_cmds - 1].pid, &t0, 0);
+		if (WIFEXITED(status)) last_status = WEXITSTATUS(status);
+		if (WIFSIGNALED(status)) last_status = 128 + WTERMSIG(status);
+		if (WIFSTOPPED(status)) last_status = 128 + WSTOPSIG(status);
+	}
+	sigprocmask(SIG_SETMASK, &old_mask, NULL);
+	if (!failed_cmd && last_status == EXIT_FAILURE) failed_cmd = no_cmds;
+	return failed_cmd;
+}
+
+/*
+ * A spawner thread, spawns the stages handed out in spawn_stages. The first
+ * stage makes the process group of the pipeline, so the others wait for it.
+ * After a stage failed to spawn the remaining ones are not handed out. The
+ * ones other threads spawn meanwhile are killed by spawn_pipeline(), which is
+ * why exec_pipeline() checks that the commands can be executed first.
+ */
+void *spawn_worker(void *arg) {
+	pid_t pgid;
+	struct stage *stage;
+	while (1) {
+		pthread_mutex_lock(&spawn_lock);
+		while (spawn_next >= spawn_total) {
+			pthread_cond_wait(&spawn_cond, &spawn_lock);
+		}
+		if (spawn_failed) {
+			/* The remaining stages are not handed out */
+			for (; spawn_next < spawn_total; spawn_next++, spawn_done++) {
+				spawn_stages[spawn_next].pid = -1;
+				spawn_stages[spawn_next].err = 0;
+			}
+			pthread_cond_broadcast(&spawn_cond);
+			pthread_mutex_unlock(&spawn_lock);
+			continue;
+		}
+		stage = &spawn_stages[spawn_next++];
+		while (job_pgrp(&job) && stage->cmd > 1 && spawn_pgid == 0) {
+			pthread_cond_wait(&spawn_cond, &spawn_lock);
+		}
+		pgid = spawn_pgid;
+		stage->pid = -1;
+		stage->err = 0;
+		if (!spawn_failed) {
+			pthread_mutex_unlock(&spawn_lock);
+			spawn_stage(stage, pgid);
+			pthread_mutex_lock(&spawn_lock);
+		}
+		if (stage->err != 0) spawn_failed = 1;
+		if (stage->cmd == 1) spawn_pgid = stage->pid;
+		spawn_done++;
+		pthread_cond_broadcast(&spawn_cond);
+		pthread_mutex_unlock(&spawn_lock);
+	}
+	return arg;
+}
+
+/*
+ * Spawns a stage with posix_spawn(), into process group pgid or a new one if
+ * pgid is not above 0. What c_init() does in a forked child is done by the
+ * spawn attributes. The first stage takes the terminal. A pinned stage
+ * inherits the affinity of the spawner thread, which is pinned meanwhile.
+ */
+void spawn_stage(struct stage *stage, pid_t pgid) {
+	int tty = (interactive && stage->cmd == 1 && isatty(STDIN_FILENO));
+	short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t mask;
+	posix_spawnattr_init(&attr);
+	posix_spawn_file_actions_init(&actions);
+	sigemptyset(&mask);
+	posix_spawnattr_setsigmask(&attr, &mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGQUIT);
+	sigaddset(&mask, SIGTSTP);
+	sigaddset(&mask, SIGTTIN);
+	sigaddset(&mask, SIGTTOU);
+	sigaddset(&mask, SIGCHLD);
+	posix_spawnattr_setsigdefault(&attr, &mask);
+	if (job_pgrp(&job)) {
+		flags |= POSIX_SPAWN_SETPGROUP;
+		posix_spawnattr_setpgroup(&attr, pgid > 0 ? pgid : 0);
+	}
+	#ifdef SPAWN_TCSETPGRP
+	if (tty) posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+	#endif
+	posix_spawnattr_setflags(&attr, flags);
+	if (stage->in != STDIN_FILENO) {
+		posix_spawn_file_actions_adddup2(&actions, stage->in, STDIN_FILENO);
+	}
+	if (stage->out != STDOUT_FILENO) {
+		posix_spawn_file_actions_adddup2(&actions, stage->out, STDOUT_FILENO);
+	}
+	pin_cpu(stage->cpu);
+	stage->err = posix_spawn(&stage->pid, stage->path, &actions, &attr,
+		stage->args, stage->env);
+	if (stage->err != 0) stage->pid = -1;
+	if (stage->cpu >= 0) sched_setaffinity(0, sizeof(shell_cpus), &shell_cpus);
+	#ifndef SPAWN_TCSETPGRP
+	/* Without the spawn action the shell hands over the terminal */
+	if (tty && stage->pid != -1) tcsetpgrp(STDIN_FILENO, stage->pid);
+	#endif
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+}
+
+/*
+ * Forks the process, the child executes a command and the parent waits the
+ * child if background is set to 0. Piping can be made for following commands
+ * there cmd is 1 for the first command and set 2 for second, etc. The variable
+ * no_cmds should be set to number of commands for piping or 1 for a single
+ * command. If foreground execution failed return -1, else 0.
+ *
+ * dtype *const *var ⇒ var mutable, *var const, **var mutable
+ * (var is a: pointer to const-pointer to dtype)
+ */
+int fork_exec_wait(char *const *args, int cmd, int no_cmds, int background) {
+	static int **pipe_fds, n;
+	static pid_t pgid; /* of the first command, the others join it */
+	struct timeval t0;
+	int err = 0, err_pipe[2], fds[3], i, return_value = 0, status = 0;
+	pid_t c_pid = -1;
+	sigset_t chld, old_mask;
+	builtin_fn builtin = resolved_cmds->builtins[cmd - 1];
+	char const *path = resolved_cmds->paths[cmd - 1];
+	char *const *env = get_envp();
+	if (PIPING && FIRST_CMD) {
+		/* Allocates for no_cmds-1 pipes */
+		pipe_fds = malloc((no_cmds - 1) * sizeof(int *));
+		for (i = 0; i < (no_cmds - 1); i++) {
+			/* Allocates for two file descriptors, read and write end */
+			pipe_fds[i] = malloc(2 * sizeof(int));
+			/* Retrive file descriptors, closed on exec unless dup'ed */
+			if (pipe2(pipe_fds[i], O_CLOEXEC) == -1) {
+				fprintf(stderr, "fork_exec_wait: Could not pipe\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		n = 0; /* pipe count */
+	}
+	if (PIPING && MIDDLE_CMD) n++;
+	if (!PIPING || FIRST_CMD) pgid = 0;
+	/* Stdin, stdout and stderr of the child */
+	fds[0] = STDIN_FILENO;
+	fds[1] = STDOUT_FILENO;
+	fds[2] = STDERR_FILENO;
+	if (PIPING && !FIRST_CMD) fds[0] = pipe_fds[MIDDLE_CMD ? n - 1 : n][READ_END];
+	if (PIPING && !LAST_CMD) fds[1] = pipe_fds[n][WRITE_END];
+	/* Keep the SIGCHLD handler from reaping the child before c_wait does */
+	sigemptyset(&chld);
+	sigaddset(&chld, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &chld, &old_mask);
+	gettimeofday(&t0, NULL); /* start stopwatch */
+	fflush(stdout); /* or a piped built in command prints it again */
+	/* Spawn by the zygote, or fork. Exec failure comes back on err_pipe. */
+	if (builtin == NULL && path != NULL) {
+		c_pid = zygote_spawn(path, args, env, fds, !background, pgid,
+			stage_cpu(cmd), &err);
+	}
+	if (c_pid == -1) {
+		if (pipe2(err_pipe, O_CLOEXEC) == -1 || (c_pid = fork()) == -1) {
+			fprintf(stderr, "fork_exec_wait: Could not fork\n");
+			exit(EXIT_FAILURE);
+		}
+		if (c_pid > 0) err = exec_error(err_pipe);
+	}
+	/* Exec (child) */
+	if (c_pid == 0) {
+		close(err_pipe[READ_END]);
+		sigprocmask(SIG_SETMASK, &old_mask, NULL);
+		c_init(!background, pgid, stage_cpu(cmd), &job);
+		/* The parent has closed the write end of the pipe from prev, and
+		   its number may be taken by err_pipe now */
+		if (PIPING && !FIRST_CMD && dup2(fds[0], STDIN_FILENO) == -1) {
+			perror("dup2");
+		}
+		if (PIPING && !LAST_CMD) stdout_to_pipe(pipe_fds[n]); /* to next */
+		/* A piped built in command runs in the child */
+		if (builtin != NULL) {
+			close(err_pipe[WRITE_END]);
+			for (i = 0; args[i] != NULL; i++);
+			i = builtin(i, args);
+			fflush(stdout);
+			_exit(i);
+		}
+		/* The arrary position after the last argument must be set to NULL */
+		if (path != NULL) execve(path, args, env);
+		err = (path != NULL ? errno : resolved_cmds->errs[cmd - 1]);
+		if (write(err_pipe[WRITE_END], &err, sizeof(err)) == -1) perror("write");
+		_exit(127);
+	}
+	/* Wait (parent) */
+	else {
+		/* Also here, so the group is there when the next command joins it */
+		if (job_pgrp(&job)) setpgid(c_pid, pgid == 0 ? c_pid : pgid);
+		if (pgid == 0) pgid = job_pgid = c_pid;
+		if (PIPING && !LAST_CMD) close(fds[1]); /* widowing pipe */
+		if (PIPING && !FIRST_CMD) close(fds[0]); /* read by the child only */
+		if (err == 0) timer_add(job_timer, c_pid, pgid);
+		if (err != 0) {
+			/* Not executed, and the following commands are not spawned */
+			waitpid(c_pid, NULL, 0);
+			exec_failed(args[0], err);
+			if (interactive && isatty(STDIN_FILENO)) {
+				tcsetpgrp(STDIN_FILENO, getpgid(shell_pid));
+			}
+			if (PIPING && !LAST_CMD) close(pipe_fds[n][READ_END]);
+			for (i = n + 1; i < no_cmds - 1; i++) {
+				close(pipe_fds[i][READ_END]);
+				close(pipe_fds[i][WRITE_END]);
+			}
+			return_value = -1;
+		} else if (!background && LAST_CMD) {
+			if (interactive) {
+				fprintf(stdout, "[%d] Spawned in foreground\n", c_pid);
+			}
+			status = c_wait(c_pid, &t0, 0);
+			if (WIFEXITED(status)) last_status = WEXITSTATUS(status);
+			if (WIFSIGNALED(status)) last_status = 128 + WTERMSIG(status);
+			if (WIFSTOPPED(status)) last_status = 128 + WSTOPSIG(status);
+		} else {
+			if (interactive) {
+				fprintf(stdout, "[%d] Spawned in background\n", c_pid);
+			}
+			if (background) {
+				add_job(c_pid, job_pgrp(&job) ? c_pid : 0, JOB_RUNNING);
+			}
+			last_status = 0;
+		}
+	}
+	sigprocmask(SIG_SETMASK, &old_mask, NULL);
+	if (!background && WEXITSTATUS(status) == EXIT_FAILURE) return_value = -1;
+	if (PIPING && (LAST_CMD || (return_value == -1))) {
+		for (i = 0; i < no_cmds - 1; i++) free(pipe_fds[i]);
+		free(pipe_fds);
+	}
+	return return_value;
+}
+
+/*
+ * Init child. The child joins process group pgid, the one of the first
+ * command of its pipeline, or leads a new one if pgid is 0. Children of a
+ * script stay in the process group of the shell, unless they are timed, see
+ * job_pgrp(). The child is pinned to cpu unless it is -1, and scheduled by
+ * opts unless it is NULL.
+ */
+void c_init(int foreground, pid_t pgid, int cpu, struct job_opts const *opts) {
+	pid_t c_pid = getpid();
+	pin_cpu(cpu);
+	if (opts != NULL) {
+		set_sched(opts);
+		set_limits(opts);
+	}
+	/* A group whose commands have all been reaped is gone, then lead one */
+	if ((opts != NULL ? job_pgrp(opts) : interactive) &&
+		(pgid == 0 || setpgid(c_pid, pgid) == -1)) {
+		setpgid(c_pid, c_pid);
+	}
+	if (interactive && foreground) {
+		/* The child takes the terminal */
+		if (tcsetpgrp(STDIN_FILENO, getpgid(c_pid)) == -1) perror("tcsetpgrp");
+	}
+	/* Signal handling to default */
+	signal(SIGINT , SIG_DFL);
+	signal(SIGQUIT, SIG_DFL);
+	signal(SIGTSTP, SIG_DFL);
+	signal(SIGWINCH, SIG_DFL);
+	signal(SIGTTIN, SIG_DFL);
+	signal(SIGTTOU, SIG_DFL);
+	signal(SIGCHLD, SIG_DFL);
+	/* The signal records of the shell are not woken for the child */
+	if (sig_pipe[READ_END] != -1) {
+		close(sig_pipe[READ_END]);
+		close(sig_pipe[WRITE_END]);
+		sig_pipe[READ_END] = sig_pipe[WRITE_END] = -1;
+	}
+}
+
+/*
+ * Takes a prefix of a pipeline from the start of the first command, args,
+ * into job. Returns the number of words taken, 0 if there is no prefix, or
+ * -1 if it is bad. The prefixes are
+ *   pin, nopin                  pin the stages to CPUs, or not
+ *   nice [-n N]                 add N, or NICE_DEFAULT, to the niceness
+ *   sched batch|idle            run with SCHED_BATCH or SCHED_IDLE
+ *   ionice [-c class] [-n N]    I/O class 1 to 3 as ionice(1), level 0 to 7
+ *   limit [-m MB] [-t s] [-n files] [-c percent]
+ *                               limit the memory, CPU time, open files and
+ *                               CPU bandwidth
+ *   timeout duration            terminate the job after duration, see
+ *                               parse_duration()
+ *   every [-n count] interval   run the pipeline every interval, see
+ *                               run_every()
+ *   onchange path... --         run the pipeline when a path changes, see
+ *                               run_onchange()
+ * and are handled by the shell rather than by wrapper commands. The prefix is
+ * parsed in full before job is changed, and nice, ionice and timeout with any
+ * other options, or without a command, are left to the commands of the name.
+ */
+int job_prefix(char const **args, int no_args) {
+	char *end;
+	int class = 2, i = 1, level = 4, len = 0;
+	long n;
+	struct job_opts opts = job;
+	if (strcmp(args[0], "pin") == 0 || strcmp(args[0], "nopin") == 0) {
+		if (no_args < 2) return 0;
+		opts.pin = (args[0][0] == 'p');
+		len = 1;
+	} else if (strcmp(args[0], "nice") == 0) {
+		opts.nice = NICE_DEFAULT;
+		if (no_args > 1 && strcmp(args[1], "-n") == 0) {
+			if (no_args < 3) return 0;
+			n = strtol(args[2], &end, 10);
+			if (*end != '\0' || end == args[2] || n < -40 || n > 40) return 0;
+			opts.nice = n;
+			i = 3;
+		}
+		if (no_args <= i || args[i][0] == '-') return 0;
+		len = i;
+	} else if (strcmp(args[0], "sched") == 0) {
+		if (no_args < 3) return 0;
+		if (strcmp(args[1], "batch") == 0) {
+			opts.policy = SCHED_BATCH;
+		} else if (strcmp(args[1], "idle") == 0) {
+			opts.policy = SCHED_IDLE;
+		} else {
+			fprintf(stderr, "job_prefix: Bad policy '%s'\n", args[1]);
+			return -1;
+		}
+		len = 2;
+	} else if (strcmp(args[0], "ionice") == 0) {
+		for (; i < no_args && args[i][0] == '-'; i += 2) {
+			if (i + 1 == no_args) return 0;
+			n = strtol(args[i + 1], &end, 10);
+			if (strcmp(args[i], "-c") == 0 && *end == '\0' && n >= 1 && n <= 3) {
+				class = n;
+			} else if (strcmp(args[i], "-n") == 0 && *end == '\0' &&
+				n >= 0 && n <= 7) {
+				level = n;
+			} else {
+				return 0;
+			}
+		}
+		if (no_args <= i) return 0;
+		opts.ioprio = IOPRIO(class, class == 3 ? 0 : level);
+		len = i;
+	} else if (strcmp(args[0], "limit") == 0) {
+		for (; i + 1 < no_args && args[i][0] == '-'; i += 2) {
+			n = strtol(args[i + 1], &end, 10);
+			if (*end != '\0' || end == args[i + 1] || n <= 0 || n > INT_MAX ||
+				strlen(args[i]) != 2 || strchr("mtnc", args[i][1]) == NULL) {
+				fprintf(stderr, "job_prefix: Bad limit '%s %s'\n", args[i],
+					args[i + 1]);
+				return -1;
+			}
+			if (args[i][1] == 'm') opts.mem_mb = n;
+			if (args[i][1] == 't') opts.cpu_sec = n;
+			if (args[i][1] == 'n') opts.files = n;
+			if (args[i][1] == 'c') opts.cpu_pct = n;
+		}
+		if (no_args <= i) return 0;
+		len = i;
+	} else if (strcmp(args[0], "timeout") == 0) {
+		if (no_args < 3 || (opts.timeout_ms = parse_duration(args[1])) <= 0) {
+			return 0;
+		}
+		len = 2;
+	} else if (strcmp(args[0], "every") == 0) {
+		if (no_args > 4 && strcmp(args[1], "-n") == 0) {
+			if ((opts.every_count = atoi(args[2])) <= 0) {
+				fprintf(stderr, "job_prefix: Bad count '%s'\n", args[2]);
+				return -1;
+			}
+			i = 3;
+		}
+		if (no_args < i + 2) return 0;
+		if ((opts.every_ms = parse_duration(args[i])) <= 0) {
+			fprintf(stderr, "job_prefix: Bad interval '%s'\n", args[i]);
+			return -1;
+		}
+		len = i + 1;
+	} else if (strcmp(args[0], "onchange") == 0) {
+		while (i < no_args && strcmp(args[i], "--") != 0) i++;
+		if (i == 1 || i + 1 >= no_args) return 0;
+		/* The watches are set up in job, which frees them if they fail */
+		job = opts;
+		if ((job.watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+			perror("job_prefix");
+			return -1;
+		}
+		job.watches = malloc((i - 1) * sizeof(struct watch));
+		for (job.no_watches = 0; job.no_watches < i - 1; job.no_watches++) {
+			job.watches[job.no_watches].wd = -1;
+			malloc_strcpy(&job.watches[job.no_watches].path,
+				args[job.no_watches + 1]);
+		}
+		if (watch_paths() < job.no_watches) {
+			for (i = 0; job.watches[i].wd != -1; i++);
+			fprintf(stderr, "job_prefix: Could not watch '%s': %s\n",
+				job.watches[i].path, strerror(errno));
+			return -1;
+		}
+		return job.no_watches + 2;
+	}
+	if (len > 0) job = opts;
+	return len;
+}
+
+/*
+ * Returns 1 if the children of the job with opts lead process groups of
+ * their own, else 0. They do when interactive, and in a script when the job
+ * has a timer, for a timeout or onchange, so that it terminates their children
+ * too as timeout(1) does. The runs of every have groups of their own, for
+ * Ctrl+C, see every_key().
+ */
+int job_pgrp(struct job_opts const *opts) {
+	return (interactive || opts->timeout_ms > 0 || opts->every_ms > 0 ||
+		opts->watch_fd != -1);
+}
+
+/*
+ * Returns 1 if the job has no scheduling options or limits, else 0.
+ */
+int job_plain(void) {
+	return (job.nice == 0 && job.policy == -1 && job.ioprio == -1 &&
+		job.mem_mb == 0 && job.cpu_sec == 0 && job.files == 0 &&
+		job.cgroup == -1);
+}
+
+/*
+ * Schedules the calling process by opts: the policy and niceness in one
+ * sched_setattr(), and the I/O priority. Failures are reported and the
+ * command runs anyway.
+ */
+void set_sched(struct job_opts const *opts) {
+	int nice;
+	struct sched_attr attr;
+	if (opts->nice != 0 || opts->policy != -1) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.sched_policy = (opts->policy != -1 ? opts->policy :
+			sched_getscheduler(0));
+		errno = 0;
+		nice = getpriority(PRIO_PROCESS, 0);
+		if (errno != 0) nice = 0;
+		nice += opts->nice;
+		attr.sched_nice = (nice < -20 ? -20 : nice > 19 ? 19 : nice);
+		if (syscall(SYS_sched_setattr, 0, &attr, 0) == -1) {
+			perror("sched_setattr");
+		}
+	}
+	/* The first argument is IOPRIO_WHO_PROCESS */
+	if (opts->ioprio != -1 &&
+		syscall(SYS_ioprio_set, 1, 0, opts->ioprio) == -1) {
+		perror("ioprio_set");
+	}
+}
+
+/*
+ * Limits the calling process by opts: the memory, CPU time and open files,
+ * and moves it into the cgroup of the job unless clone3() placed it there.
+ * Failures are reported and the command runs anyway.
+ */
+void set_limits(struct job_opts const *opts) {
+	int fd;
+	struct rlimit rl;
+	if (opts->mem_mb > 0) {
+		rl.rlim_cur = rl.rlim_max = (rlim_t)opts->mem_mb << 20;
+		if (setrlimit(RLIMIT_AS, &rl) == -1) perror("setrlimit");
+	}
+	if (opts->cpu_sec > 0) {
+		/* SIGXCPU at the limit, SIGKILL a second later */
+		rl.rlim_cur = opts->cpu_sec;
+		rl.rlim_max = opts->cpu_sec + 1;
+		if (setrlimit(RLIMIT_CPU, &rl) == -1) perror("setrlimit");
+	}
+	if (opts->files > 0) {
+		rl.rlim_cur = rl.rlim_max = opts->files;
+		if (setrlimit(RLIMIT_NOFILE, &rl) == -1) perror("setrlimit");
+	}
+	if (opts->cgroup != -1) {
+		fd = openat(opts->cgroup, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+		if (fd == -1 || write_all(fd, "0", 1) == -1) perror("cgroup.procs");
+		if (fd != -1) close(fd);
+	}
+}
+
+/*
+ * Returns the CPU to pin stage cmd of the running pipeline to, or -1 if its
+ * stages are not pinned. The stages take the CPUs in the order of
+ * cpu_topology(), so adjacent stages share a cache.
+ */
+int stage_cpu(int cmd) {
+	if (!job.pin || cpu_topology() < 2) return -1;
+	return cpu_order[(cmd - 1) % no_cpus];
+}
+
+/*
+ * Reads which of the CPUs the shell may run on share caches, and orders them
+ * in cpu_order by the L3 and then the L2 cache they share, so that CPUs next
+ * to each other pass pipe buffers through the nearest cache. Returns the
+ * number of CPUs.
+ */
+int cpu_topology(void) {
+	int cpu;
+	struct cpu_place places[CPU_SETSIZE];
+	if (no_cpus >= 0) return no_cpus;
+	no_cpus = 0;
+	if (sched_getaffinity(0, sizeof(shell_cpus), &shell_cpus) == -1) return 0;
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &shell_cpus)) continue;
+		places[no_cpus].cpu = cpu;
+		places[no_cpus].l2 = cache_group(cpu, 2);
+		places[no_cpus++].l3 = cache_group(cpu, 3);
+	}
+	qsort(places, no_cpus, sizeof(struct cpu_place), compare_places);
+	for (cpu = 0; cpu < no_cpus; cpu++) cpu_order[cpu] = places[cpu].cpu;
+	return no_cpus;
+}
+
+/*
+ * Returns the first CPU of those sharing the cache of level with cpu, from
+ * /sys/devices/system/cpu, or -1 if not known.
+ */
+int cache_group(int cpu, int level) {
+	char dir[64], path[PATH_MAX];
+	int first = -1, found = 0, i, n;
+	FILE *file;
+	for (i = 0; !found; i++) {
+		sprintf(dir, "/sys/devices/system/cpu/cpu%d/cache/index%d", cpu, i);
+		sprintf(path, "%s/level", dir);
+		if ((file = fopen(path, "r")) == NULL) break;
+		found = (fscanf(file, "%d", &n) == 1 && n == level);
+		fclose(file);
+	}
+	if (!found) return -1;
+	sprintf(path, "%s/shared_cpu_list", dir);
+	if ((file = fopen(path, "r")) == NULL) return -1;
+	if (fscanf(file, "%d", &first) != 1) first = -1;
+	fclose(file);
+	return first;
+}
+
+/*
+ * Orders CPUs by L3 cache, L2 cache and number.
+ */
+int compare_places(void const *a, void const *b) {
+	struct cpu_place const *x = a, *y = b;
+	if (x->l3 != y->l3) return x->l3 - y->l3;
+	if (x->l2 != y->l2) return x->l2 - y->l2;
+	return x->cpu - y->cpu;
+}
+
+/*
+ * Pins the calling process or thread to cpu, unless it is -1.
+ */
+void pin_cpu(int cpu) {
+	cpu_set_t set;
+	if (cpu < 0) return;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+		perror("sched_setaffinity");
+	}
+}
+
+/*
+ * Starts the zygote, a helper process that spawns commands for the shell. It
+ * is forked at init, when the shell is still small, so spawning from it does
+ * not copy the page tables of a shell that has grown with history and caches.
+ * Its children are created with CLONE_PARENT and so are children of the
+ * shell, which waits for them as for forked ones. If the zygote cannot be
+ * started commands are forked from the shell.
+ */
+void zygote_start(void) {
+	int fds[2];
+	pid_t pid;
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) == -1) return;
+	if ((pid = fork()) == -1) {
+		close(fds[0]);
+		close(fds[1]);
+		return;
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		zygote_main(fds[1]);
+	}
+	close(fds[1]);
+	zygote_fd = fds[0];
+	zygote_pid = pid;
+}
+
+/*
+ * The zygote, serves spawn requests on fd until the shell goes away. A
+ * request is a struct spawn_request with the path, arguments and environment
+ * after it, and stdin, stdout, stderr and the working directory of the
+ * command passed as file descriptors, and the cgroup of the job if any. The
+ * answer is a struct spawn_reply, sent when the child has executed the
+ * command or failed to.
+ */
+void zygote_main(int fd) {
+	static char buf[ZYGOTE_MAX];
+	char cbuf[CMSG_SPACE(5 * sizeof(int))], *p, **args, **env;
+	int err, err_pipe[2], fds[5], i, no_fds;
+	ssize_t len;
+	struct clone_args clone;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	struct msghdr msg;
+	struct spawn_request *req = (struct spawn_request *)buf;
+	struct spawn_reply reply;
+	/* Die with the shell, and leave its signals to it */
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+	if (getppid() != shell_pid) _exit(EXIT_SUCCESS);
+	signal(SIGINT, SIG_IGN);
+	signal(SIGQUIT, SIG_IGN);
+	signal(SIGTSTP, SIG_IGN);
+	signal(SIGCHLD, SIG_DFL);
+	while (1) {
+		memset(&msg, 0, sizeof(msg));
+		iov.iov_base = buf;
+		iov.iov_len = sizeof(buf);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+		if ((len = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) <= 0) {
+			if (len == -1 && errno == EINTR) continue;
+			_exit(EXIT_SUCCESS);
+		}
+		no_fds = 0;
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if (cmsg != NULL && cmsg->cmsg_type == SCM_RIGHTS) {
+			no_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cmsg), no_fds * sizeof(int));
+		}
+		reply.pid = -1;
+		reply.err = 0;
+		if (no_fds >= 4 && (size_t)len >= sizeof(*req) &&
+			pipe2(err_pipe, O_CLOEXEC) == 0) {
+			/* Point into the strings of the request */
+			args = malloc((req->no_args + req->no_env + 2) * sizeof(char *));
+			env = args + req->no_args + 1;
+			p = buf + sizeof(*req) + strlen(buf + sizeof(*req)) + 1;
+			for (i = 0; i < req->no_args; i++, p += strlen(p) + 1) args[i] = p;
+			args[i] = NULL;
+			for (i = 0; i < req->no_env; i++, p += strlen(p) + 1) env[i] = p;
+			env[i] = NULL;
+			/* Into the cgroup of the job, which the child may join itself */
+			req->opts.cgroup = (no_fds == 5 ? fds[4] : -1);
+			reply.pid = -1;
+			#ifdef SYS_clone3
+			if (no_fds == 5) {
+				memset(&clone, 0, sizeof(clone));
+				clone.flags = CLONE_PARENT | CLONE_INTO_CGROUP;
+				clone.exit_signal = SIGCHLD;
+				clone.cgroup = fds[4];
+				reply.pid = syscall(SYS_clone3, &clone, sizeof(clone));
+				if (reply.pid == 0) req->opts.cgroup = -1;
+			}
+			#endif
+			if (reply.pid == -1) {
+				reply.pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD,
+					NULL, NULL, NULL, NULL);
+			}
+			if (reply.pid == 0) {
+				close(err_pipe[READ_END]);
+				interactive = req->interactive;
+				c_init(req->foreground, req->pgid, req->cpu, &req->opts);
+				for (i = 0; i < 3 && dup2(fds[i], i) != -1; i++);
+				if (i == 3 && fchdir(fds[3]) == 0) {
+					execve(buf + sizeof(*req), args, env);
+				}
+				err = errno;
+				if (write(err_pipe[WRITE_END], &err, sizeof(err)) == -1) {
+					_exit(126);
+				}
+				_exit(127);
+			}
+			if (reply.pid == -1) {
+				close(err_pipe[READ_END]);
+				close(err_pipe[WRITE_END]);
+			} else {
+				reply.err = exec_error(err_pipe);
+			}
+			free(args);
+		}
+		for (i = 0; i < no_fds; i++) close(fds[i]);
+		if (send(fd, &reply, sizeof(reply), MSG_NOSIGNAL) == -1) {
+			_exit(EXIT_SUCCESS);
+		}
+	}
+}
+
+/*
+ * Has the zygote spawn path with arguments args and environment env, with
+ * the file descriptors in fds as stdin, stdout and stderr, into process group
+ * pgid or a new one if pgid is 0, like c_init(). Returns the pid of the
+ * child, or -1 if the zygote could not spawn it, and then the caller forks
+ * instead. The child is pinned to cpu unless it is -1. If exec failed err is
+ * set to the errno, else to 0.
+ */
+pid_t zygote_spawn(char const *path, char *const *args, char *const *env,
+	int const *fds, int foreground, pid_t pgid, int cpu, int *err) {
+	static char *buf = NULL;
+	static int cap = 0;
+	char cbuf[CMSG_SPACE(5 * sizeof(int))];
+	int all[5], i, len, n, no_fds = (job.cgroup != -1 ? 5 : 4);
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	struct msghdr msg;
+	struct spawn_request req;
+	struct spawn_reply reply;
+	if (zygote_fd == -1) return -1;
+	/* The request */
+	req.foreground = foreground;
+	req.pgid = pgid;
+	req.interactive = interactive;
+	req.cpu = cpu;
+	req.opts = job;
+	len = sizeof(req) + strlen(path) + 1;
+	for (req.no_args = 0; args[req.no_args] != NULL; req.no_args++) {
+		len += strlen(args[req.no_args]) + 1;
+	}
+	for (req.no_env = 0; env[req.no_env] != NULL; req.no_env++) {
+		len += strlen(env[req.no_env]) + 1;
+	}
+	if (len > ZYGOTE_MAX) return -1;
+	buf = grow(buf, &cap, len, 1);
+	memcpy(buf, &req, sizeof(req));
+	n = sizeof(req);
+	n += sprintf(buf + n, "%s", path) + 1;
+	for (i = 0; i < req.no_args; i++) n += sprintf(buf + n, "%s", args[i]) + 1;
+	for (i = 0; i < req.no_env; i++) n += sprintf(buf + n, "%s", env[i]) + 1;
+	/* The file descriptors */
+	memcpy(all, fds, 3 * sizeof(int));
+	if ((all[3] = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC)) == -1) return -1;
+	all[4] = job.cgroup;
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = CMSG_SPACE(no_fds * sizeof(int));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(no_fds * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), all, no_fds * sizeof(int));
+	n = sendmsg(zygote_fd, &msg, MSG_NOSIGNAL);
+	close(all[3]);
+	if (n == -1 || recv(zygote_fd, &reply, sizeof(reply), 0) != sizeof(reply)) {
+		/* The zygote is gone, fork from now on */
+		close(zygote_fd);
+		zygote_fd = -1;
+		return -1;
+	}
+	*err = reply.err;
+	return reply.pid;
+}
+
+/*
+ * Returns the errno that a child writes on the close-on-exec pipe err_pipe
+ * if exec fails, or 0 when exec closed the pipe. The pipe is closed.
+ */
+int exec_error(int *err_pipe) {
+	int err = 0;
+	close(err_pipe[WRITE_END]);
+	while (read(err_pipe[READ_END], &err, sizeof(err)) == -1 && errno == EINTR);
+	close(err_pipe[READ_END]);
+	return err;
+}
+
+/*
+ * Reports that command name could not be executed because of errno err. The
+ * exit status is 127 if it was not found, else 126, as in other shells.
+ */
+void exec_failed(char const *name, int err) {
+	if (err == ENOENT) {
+		fprintf(stderr, "%s: Command not found\n", name);
+	} else {
+		fprintf(stderr, "%s: %s\n", name, strerror(err));
+	}
+	last_status = (err == ENOENT ? 127 : 126);
+}
+
+/*
+ * Waits for a child in the foreground. If process is in background set cont=1
+ * for give over the terminal and continue the process, otherwise set 0. Returns
+ * status from waitpid.
+ */
+int c_wait(pid_t c_pid, struct timeval const *t0, int cont) {
+	int status = 0;
+	struct timeval t1, diff;
+	if (cont) {
+		if (tcsetpgrp(STDIN_FILENO, getpgid(c_pid)) == -1) perror("tcsetpgrp");
+		/* The whole pipeline */
+		if (kill(-getpgid(c_pid), SIGCONT) == -1) perror("kill");
+	}
+	/* Wait for childs death, WUNTRACED: also return if a child has stopped */
+	if (wait_events(c_pid, &status) > 0) {
+		print_status(c_pid, status);
+		if (WIFSTOPPED(status)) {
+			add_job(c_pid, interactive ? getpgid(c_pid) : 0, JOB_STOPPED);
+		} else {
+			update_job(c_pid, status);
+		}
+		if (t0 != NULL) {
+			gettimeofday(&t1, NULL); /* stop stopwatch */
+			diff.tv_sec = t1.tv_sec - t0->tv_sec;
+			diff.tv_usec = t1.tv_usec - t0->tv_usec;
+			last_runtime = diff.tv_sec * 1000 + diff.tv_usec / 1000;
+		}
+		if (t0 != NULL && interactive) {
+			fprintf(stdout, "Run time was %.0f ms\n",
+				diff.tv_sec * 1000.0 + diff.tv_usec / 1000.0);
+		}
+	}
+	/* Reclaim the terminal */
+	if (interactive && tcsetpgrp(STDIN_FILENO, getpgid(shell_pid)) == -1) {
+		perror("tcsetpgrp");
+	}
+	return status;
+}
+
+/*
+ * Waits for child c_pid like waitpid() with WUNTRACED, running the events of
+ * the event loop meanwhile. SIGCHLD is taken from a signalfd, so the other
+ * children are reaped here too.
+ */
+pid_t wait_events(pid_t c_pid, int *status) {
+	pid_t pid;
+	sigset_t chld, old_mask;
+	struct pollfd fds[2];
+	struct signalfd_siginfo info;
+	sigemptyset(&chld);
+	sigaddset(&chld, SIGCHLD);
+	if (no_events == 0 || (chld_fd == -1 &&
+		(chld_fd = signalfd(-1, &chld, SFD_NONBLOCK | SFD_CLOEXEC)) == -1)) {
+		return waitpid(c_pid, status, WUNTRACED);
+	}
+	sigprocmask(SIG_BLOCK, &chld, &old_mask);
+	fds[0].fd = chld_fd;
+	fds[1].fd = ev_epoll;
+	fds[0].events = fds[1].events = POLLIN;
+	while ((pid = waitpid(c_pid, status, WUNTRACED | WNOHANG)) == 0) {
+		if (poll(fds, 2, -1) == -1 && errno != EINTR) break;
+		while (read(chld_fd, &info, sizeof(info)) > 0);
+		if (fds[1].revents & POLLIN) ev_run_once(0);
+	}
+	#ifndef POLLING
+	/* As in sig_drain(), the handler is kept out while reaping, as any
+	   signal it catches would add to the records too */
+	sigfillset(&chld);
+	sigprocmask(SIG_BLOCK, &chld, NULL);
+	reap_children();
+	#endif
+	sigprocmask(SIG_SETMASK, &old_mask, NULL);
+	return pid;
+}
+
+/*------------------------------------------------------------------------------
+ * BUILT IN COMMANDS
+ */
+
+/*
+ * Returns the function of the built in command name, or NULL if there is no
+ * such command. Names are first told apart by their length.
+ */
+builtin_fn find_builtin(char const *name) {
+	switch (strlen(name)) {
+	case 1:
+		if (strcmp(name, "j") == 0) return builtin_j;
+		break;
+	case 2:
+		if (strcmp(name, "cd") == 0) return builtin_cd;
+		if (strcmp(name, "fg") == 0) return builtin_fg;
+		if (strcmp(name, "bg") == 0) return builtin_bg;
+		break;
+	case 4:
+		if (strcmp(name, "exit") == 0) return builtin_exit;
+		if (strcmp(name, "hash") == 0) return builtin_hash;
+		if (strcmp(name, "jobs") == 0) return builtin_jobs;
+		if (strcmp(name, "kill") == 0) return builtin_kill;
+		if (strcmp(name, "wait") == 0) return builtin_wait;
+		break;
+	case 5:
+		if (strcmp(name, "bench") == 0) return builtin_bench;
+		if (strcmp(name, "local") == 0) return builtin_local;
+		if (strcmp(name, "unset") == 0) return builtin_unset;
+		break;
+	case 6:
+		if (strcmp(name, "export") == 0) return builtin_export;
+		break;
+	case 7:
+		if (strcmp(name, "waitfor") == 0) return builtin_waitfor;
+		break;
+	case 8:
+		if (strcmp(name, "checkEnv") == 0) return builtin_check_env;
+		break;
+	}
+	return NULL;
+}
+
+/*
+ * bench [MB], pipe throughput unpinned and pinned to CPUs near and far.
+ */
+int builtin_bench(int no_args, char const **args) {
+	long mb = (no_args == 2 ? atol(args[1]) : BENCH_MB);
+	if (no_args > 2 || mb <= 0) return EXIT_FAILURE;
+	if (cpu_topology() < 2) {
+		fprintf(stderr, "bench: Pinning needs two CPUs\n");
+		return EXIT_FAILURE;
+	}
+	if (bench_pipe(mb, -1, -1) == -1 ||
+		bench_pipe(mb, cpu_order[0], cpu_order[1]) == -1 ||
+		bench_pipe(mb, cpu_order[0], cpu_order[no_cpus - 1]) == -1) {
+		return EXIT_FAILURE;
+	}
+	return 0;
+}
+
+/*
+ * bg [%n | pid], continues a stopped job in the background, by default the
+ * latest.
+ */
+int builtin_bg(int no_args, char const **args) {
+	int id;
+	if (no_args > 2 || (id = find_job(args[1], "bg")) == 0) return EXIT_FAILURE;
+	if (jobs[id].state != JOB_STOPPED) {
+		fprintf(stderr, "bg: Job is not stopped\n");
+		return EXIT_FAILURE;
+	}
+	if (signal_job(id, SIGCONT) == -1) return EXIT_FAILURE;
+	if (interactive) fprintf(stdout, "[%d] %s &\n", id, jobs[id].cmd);
+	return 0;
+}
+
+/*
+ * cd [dir]
+ */
+int builtin_cd(int no_args, char const **args) {
+	if (no_args > 2) return EXIT_FAILURE;
+	return (change_dir(no_args == 1 ? "~" : args[1]) == -1 ? EXIT_FAILURE : 0);
+}
+
+/*
+ * checkEnv [pattern]
+ */
+int builtin_check_env(int no_args, char const **args) {
+	if (no_args > 2) return EXIT_FAILURE;
+	check_env(args);
+	return 0;
+}
+
+/*
+ * exit, in a piped child it only ends the child.
+ */
+int builtin_exit(int no_args, char const **args) {
+	if (no_args != 1) return EXIT_FAILURE;
+	if (getpid() != shell_pid) exit(EXIT_SUCCESS);
+	term_all();
+	return 0;
+}
+
+/*
+ * export [NAME[=value]]..., without arguments the exported variables are
+ * listed.
+ */
+int builtin_export(int no_args, char const **args) {
+	char *const *env;
+	int i, status = 0;
+	if (no_args == 1) {
+		for (env = get_envp(); *env != NULL; env++) {
+			fprintf(stdout, "export %s\n", *env);
+		}
+	}
+	for (i = 1; i < no_args; i++) {
+		if (var_assign(args[i], 1) == 0) continue;
+		if (valid_name(args[i], strlen(args[i]))) {
+			var_set(args[i], var_get(args[i]), 1);
+		} else {
+			fprintf(stderr, "export: Bad variable name '%s'\n", args[i]);
+			status = EXIT_FAILURE;
+		}
+	}
+	return status;
+}
+
+/*
+ * fg [%n | pid], continues a job in the foreground, by default the latest,
+ * and returns its exit status.
+ */
+int builtin_fg(int no_args, char const **args) {
+	int id, status;
+	pid_t pid;
+	if (no_args > 2 || (id = find_job(args[1], "fg")) == 0) return EXIT_FAILURE;
+	/* It may have been reaped without the job knowing yet */
+	sig_drain(NULL);
+	if (jobs[id].state == JOB_DONE) {
+		fprintf(stderr, "fg: Job is done\n");
+		return EXIT_FAILURE;
+	}
+	pid = jobs[id].pid;
+	jobs[id].state = JOB_RUNNING;
+	status = c_wait(pid, NULL, 1);
+	if ((id = job_of(pid)) != 0 && jobs[id].state == JOB_DONE) free_job(id);
+	if (WIFSTOPPED(status)) return 128 + WSTOPSIG(status);
+	if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+	return WEXITSTATUS(status);
+}
+
+/*
+ * hash [-r], lists or with -r forgets the found paths of commands.
+ */
+int builtin_hash(int no_args, char const **args) {
+	int i;
+	struct var *cmd;
+	if (no_args == 2 && strcmp(args[1], "-r") == 0) {
+		forget_commands();
+		return 0;
+	}
+	if (no_args != 1) return EXIT_FAILURE;
+	for (i = 0; i < VAR_BUCKETS; i++) {
+		for (cmd = cmd_paths[i]; cmd != NULL; cmd = cmd->next) {
+			fprintf(stdout, "%s=%s\n", cmd->name, cmd->value);
+		}
+	}
+	return 0;
+}
+
+/*
+ * j [fragment ...]
+ */
+int builtin_j(int no_args, char const **args) {
+	if (no_args == 1) {
+		list_dirs();
+		return 0;
+	}
+	return (jump_dir(args + 1) == -1 ? EXIT_FAILURE : 0);
+}
+
+/*
+ * jobs, lists the jobs. Those that are done are listed once, then forgotten.
+ */
+int builtin_jobs(int no_args, char const **args) {
+	char state[16];
+	int id;
+	if (no_args != 1) return EXIT_FAILURE;
+	sig_drain(NULL);
+	for (id = 1; id < job_cap; id++) {
+		if (jobs[id].pid == 0) continue;
+		if (jobs[id].state == JOB_RUNNING) {
+			strcpy(state, "Running");
+		} else if (jobs[id].state == JOB_STOPPED) {
+			strcpy(state, "Stopped");
+		} else if (jobs[id].status == 0) {
+			strcpy(state, "Done");
+		} else {
+			sprintf(state, "Exit %d", jobs[id].status);
+		}
+		fprintf(stdout, "[%d]%c %-8s %6d  %s\n", id,
+			id == job_current ? '+' : ' ', state, jobs[id].pid, jobs[id].cmd);
+		/* A piped jobs runs in a child, the jobs stay with the shell */
+		if (jobs[id].state == JOB_DONE && getpid() == shell_pid) free_job(id);
+	}
+	return 0;
+}
+
+/*
+ * kill [-SIG | -s SIG] [--] %n | pid..., sends SIG, by default SIGTERM, to
+ * jobs and processes, a negative pid is a process group. SIG is a number, 0
+ * only checks that they exist, or a name, with or without SIG in front.
+ * kill -l [SIG | status]... lists the names of the signals.
+ */
+int builtin_kill(int no_args, char const **args) {
+	static char const *const names[] = {
+		"HUP", "INT", "QUIT", "KILL", "USR1", "USR2", "PIPE", "ALRM", "TERM",
+		"CONT", "STOP", "TSTP", NULL
+	};
+	static int const sigs[] = {
+		SIGHUP, SIGINT, SIGQUIT, SIGKILL, SIGUSR1, SIGUSR2, SIGPIPE, SIGALRM,
+		SIGTERM, SIGCONT, SIGSTOP, SIGTSTP
+	};
+	char const *name;
+	char *end;
+	int first, i, id, list = 0, sig = SIGTERM, status = 0;
+	long n;
+	pid_t pid;
+	for (first = 1; first < no_args && args[first][0] == '-' &&
+		args[first][1] != '\0'; first++) {
+		if (strcmp(args[first], "--") == 0) {
+			first++;
+			break;
+		} else if (strcmp(args[first], "-l") == 0) {
+			list = 1;
+			continue;
+		}
+		name = args[first] + 1;
+		if (strcmp(args[first], "-s") == 0) {
+			if (++first == no_args) {
+				fprintf(stderr, "kill: Missing signal\n");
+				return EXIT_FAILURE;
+			}
+			name = args[first];
+		}
+		if (strncmp(name, "SIG", 3) == 0) name += 3;
+		for (i = 0; names[i] != NULL && strcmp(names[i], name) != 0; i++);
+		n = strtol(name, &end, 10);
+		if (names[i] != NULL) {
+			sig = sigs[i];
+		} else if (*name != '\0' && *end == '\0' && n >= 0 && n <= INT_MAX) {
+			sig = n;
+		} else {
+			fprintf(stderr, "kill: Unknown signal '%s'\n", name);
+			return EXIT_FAILURE;
+		}
+	}
+	if (list) {
+		/* By number, an exit status of 128 + SIG is the same as SIG */
+		for (i = 0; first == no_args && names[i] != NULL; i++) {
+			fprintf(stdout, "%s%c", names[i], names[i + 1] == NULL ? '\n' : ' ');
+		}
+		for (; first < no_args; first++) {
+			n = strtol(args[first], &end, 10);
+			if (n > 128) n -= 128;
+			for (i = 0; names[i] != NULL && sigs[i] != n; i++);
+			if (*args[first] == '\0' || *end != '\0' || names[i] == NULL) {
+				fprintf(stderr, "kill: Unknown signal '%s'\n", args[first]);
+				status = EXIT_FAILURE;
+			} else {
+				fprintf(stdout, "%s\n", names[i]);
+			}
+		}
+		return status;
+	}
+	if (first == no_args) {
+		fprintf(stderr, "kill: Missing %%n or pid\n");
+		return EXIT_FAILURE;
+	}
+	for (i = first; i < no_args; i++) {
+		if (args[i][0] == '%') {
+			/* A job that is done may have its pid taken by another process */
+			if ((id = find_job(args[i], "kill")) == 0 ||
+				jobs[id].state == JOB_DONE || signal_job(id, sig) == -1) {
+				status = EXIT_FAILURE;
+			}
+			continue;
+		}
+		n = strtol(args[i], &end, 10);
+		if (args[i][0] == '\0' || *end != '\0' || (pid = n) != n ||
+			kill(pid, sig) == -1) {
+			fprintf(stderr, "kill: Could not signal '%s'\n", args[i]);
+			status = EXIT_FAILURE;
+		} else if (sig == SIGCONT && (id = job_of(pid)) != 0 &&
+			jobs[id].state == JOB_STOPPED) {
+			jobs[id].state = JOB_RUNNING;
+		}
+	}
+	return status;
+}
+
+/*
+ * local NAME=value..., sets variables. New ones are not exported to commands,
+ * and an exported one stays exported.
+ */
+int builtin_local(int no_args, char const **args) {
+	int i, status = 0;
+	for (i = 1; i < no_args; i++) {
+		if (var_assign(args[i], -1) == -1) {
+			fprintf(stderr, "local: Bad assignment '%s'\n", args[i]);
+			status = EXIT_FAILURE;
+		}
+	}
+	return status;
+}
+
+/*
+ * unset NAME...
+ */
+int builtin_unset(int no_args, char const **args) {
+	int i;
+	for (i = 1; i < no_args; i++) var_unset(args[i]);
+	return 0;
+}
+
+/*
+ * wait [-n] [%n | pid]..., waits until the jobs are done, or until all are
+ * and the other children too if none is given, and returns the exit status
+ * of the last. With -n it returns the status of the next job to be done, or
+ * of one that is done already. A stopped job is not waited for. The status
+ * is 127 if there is no such job. The jobs are updated by the signal records,
+ * so it wakes up as soon as a job is done.
+ */
+int builtin_wait(int no_args, char const **args) {
+	int i, id, running, status = 0;
+	if (no_args == 2 && strcmp(args[1], "-n") == 0) {
+		while (1) {
+			sig_drain(NULL);
+			for (id = 1, running = 0; id < job_cap; id++) {
+				if (jobs[id].pid == 0) continue;
+				if (jobs[id].state == JOB_RUNNING) running = 1;
+				if (jobs[id].state != JOB_DONE) continue;
+				status = jobs[id].status;
+				free_job(id);
+				return status;
+			}
+			if (!running) return 127;
+			wait_job_event();
+		}
+	}
+	for (i = 1; i < no_args; i++) {
+		if ((id = find_job(args[i], "wait")) == 0) {
+			status = 127;
+			continue;
+		}
+		sig_drain(NULL);
+		while (jobs[id].state == JOB_RUNNING) wait_job_event();
+		status = jobs[id].status;
+		if (jobs[id].state == JOB_DONE) free_job(id);
+	}
+	if (no_args > 1) return status;
+	/* All jobs, and children that are not jobs */
+	do {
+		sig_drain(NULL);
+		for (id = 1, running = 0; id < job_cap; id++) {
+			if (jobs[id].pid != 0 && jobs[id].state == JOB_RUNNING) running = 1;
+		}
+		if (running || other_children()) wait_job_event();
+	} while (running || other_children());
+	for (id = 1; id < job_cap; id++) {
+		if (jobs[id].pid != 0 && jobs[id].state == JOB_DONE) free_job(id);
+	}
+	return 0;
+}
+
+/*
+ * waitfor [-t duration] file|gone|pid target, waits until path target
+ * exists, until it does not, or until process target has exited. The wait
+ * is on inotify or a pidfd in the event loop, so it takes no polling.
+ */
+int builtin_waitfor(int no_args, char const **args) {
+	char buf[4096], dir[PATH_MAX];
+	int done = 0, fd, ready = 0, timed_out = 0, timer = -1, wd = -1;
+	long ms = 0;
+	pid_t pid = 0;
+	struct stat st;
+	if (no_args == 5 && strcmp(args[1], "-t") == 0) {
+		if ((ms = parse_duration(args[2])) < 0) return EXIT_FAILURE;
+		args += 2;
+		no_args -= 2;
+	}
+	if (no_args != 3) return EXIT_FAILURE;
+	if (strcmp(args[1], "pid") == 0) {
+		if ((pid = atoi(args[2])) <= 0) return EXIT_FAILURE;
+		/* A process that is gone has no pidfd */
+		if ((fd = syscall(SYS_pidfd_open, pid, 0)) == -1 && errno == ESRCH) {
+			return 0;
+		}
+	} else if (strcmp(args[1], "file") == 0 || strcmp(args[1], "gone") == 0) {
+		fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	} else {
+		return EXIT_FAILURE;
+	}
+	if (fd == -1 || ev_add(fd, ev_flag, &ready) == -1) {
+		perror("waitfor");
+		if (fd != -1) close(fd);
+		return EXIT_FAILURE;
+	}
+	if (ms > 0 && (timer = timerfd_create(CLOCK_MONOTONIC,
+		TFD_NONBLOCK | TFD_CLOEXEC)) != -1) {
+		ev_add(timer, ev_flag, &timed_out);
+		timer_arm(timer, ms);
+	}
+	while (!done && !timed_out) {
+		if (pid == 0) {
+			/* Watch where the path shows up or goes, then look */
+			if (wd != -1) inotify_rm_watch(fd, wd);
+			if ((wd = inotify_add_watch(fd, watch_dir(args[2], dir),
+				WATCH_EVENTS)) == -1) {
+				perror("waitfor");
+				break;
+			}
+			if ((lstat(args[2], &st) == 0) == (args[1][0] == 'f')) done = 1;
+		}
+		while (!done && !ready && !timed_out) ev_run_once(-1);
+		if (pid != 0) done = ready;
+		while (read(fd, buf, sizeof(buf)) > 0);
+		ready = 0;
+	}
+	ev_del(fd);
+	close(fd);
+	if (timer != -1) {
+		ev_del(timer);
+		close(timer);
+	}
+	if (done) return 0;
+	return (timed_out ? TIMED_OUT : EXIT_FAILURE);
+}
+
+/*
+ * Puts the nearest directory above path that exists in dir, of PATH_MAX,
+ * where path shows up or goes. Returns dir.
+ */
+char *watch_dir(char const *path, char *dir) {
+	char *slash;
+	struct stat st;
+	snprintf(dir, PATH_MAX, "%s", path);
+	while ((slash = strrchr(dir, '/')) != NULL) {
+		if (slash == dir) {
+			dir[1] = '\0';
+			return dir;
+		}
+		*slash = '\0';
+		if (stat(dir, &st) == 0 && S_ISDIR(st.st_mode)) return dir;
+	}
+	return strcpy(dir, ".");
+}
+
+/*
+ * Change directory, "~" at the start is replaced by HOME and "-" is OLDPWD.
+ * The logical working directory follows the path as given, so ".." goes back
+ * over symbolic links. Returns 0 on success, else -1.
+ */
+int change_dir(char const *path) {
+	char const *home = var_get("HOME");
+	char *exec_path, *target;
+	if (strcmp(path, "-") == 0 && (path = var_get("OLDPWD")) == NULL) {
+		fprintf(stderr, "change_dir: OLDPWD not set\n");
+		return -1;
+	}
+	if (path[0] == '~' && (path[1] == '\0' || path[1] == '/')) {
+		/* Replace tilde by HOME environment */
+		if (home == NULL) home = "";
+		exec_path = malloc(strlen(home) + strlen(path));
+		sprintf(exec_path, "%s%s", home, path + 1);
+	} else {
+		malloc_strcpy(&exec_path, path);
+	}
+	target = logical_path(exec_path[0] == '/' ? "" : get_cwd(), exec_path);
+	if (chdir(target) == -1) {
+		/* Such as ".." in a directory that was moved, try physically */
+		free(target);
+		if (chdir(exec_path) == -1) {
+			fprintf(stderr, "change_dir: No such directory\n");
+			free(exec_path);
+			return -1;
+		}
+		/* getcwd() fails if the path is too long, "/" as in cwd_init() */
+		if ((target = getcwd(NULL, 0)) == NULL) malloc_strcpy(&target, "/");
+	}
+	set_cwd(target);
+	free(exec_path);
+	if (interactive) dirs_visit(cwd);
+	return 0;
+}
+
+/*
+ * Measures and prints the throughput of mb MB through a pipe from a writer
+ * pinned to CPU from to a reader pinned to CPU to, either may be -1 to leave
+ * it to the scheduler. Returns 0 on success, else -1.
+ */
+int bench_pipe(long mb, int from, int to) {
+	static char buf[BENCH_BLOCK];
+	double ms;
+	int fds[2];
+	long i;
+	pid_t reader, writer;
+	sigset_t chld, old_mask;
+	struct timeval t0, t1;
+	if (pipe(fds) == -1) return -1;
+	sigemptyset(&chld);
+	sigaddset(&chld, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &chld, &old_mask);
+	fflush(stdout);
+	gettimeofday(&t0, NULL);
+	if ((writer = fork()) == 0) {
+		pin_cpu(from);
+		close(fds[READ_END]);
+		for (i = 0; i < mb * (1 << 20) / BENCH_BLOCK; i++) {
+			if (write(fds[WRITE_END], buf, BENCH_BLOCK) == -1) break;
+		}
+		_exit(EXIT_SUCCESS);
+	}
+	if ((reader = fork()) == 0) {
+		pin_cpu(to);
+		close(fds[WRITE_END]);
+		while (read(fds[READ_END], buf, BENCH_BLOCK) > 0);
+		_exit(EXIT_SUCCESS);
+	}
+	close(fds[READ_END]);
+	close(fds[WRITE_END]);
+	if (writer != -1) waitpid(writer, NULL, 0);
+	if (reader != -1) waitpid(reader, NULL, 0);
+	gettimeofday(&t1, NULL);
+	sigprocmask(SIG_SETMASK, &old_mask, NULL);
+	if (writer == -1 || reader == -1) {
+		fprintf(stderr, "bench_pipe: Could not fork\n");
+		return -1;
+	}
+	ms = (t1.tv_sec - t0.tv_sec) * 1000.0 + (t1.tv_usec - t0.tv_usec) / 1000.0;
+	if (from == -1) {
+		fprintf(stdout, "unpinned       ");
+	} else {
+		fprintf(stdout, "cpu %3d to %3d ", from, to);
+	}
+	fprintf(stdout, "%8.0f MB/s\n", mb * 1000.0 / (ms > 0 ? ms : 1));
+	return 0;
+}
+
+/*
+ * Maps the directory database, a file of MAX_DIRS slots shared by all
+ * sessions and updated in place under flock(). Returns 0 on success, else -1.
+ */
+int dirs_open(void) {
+	char const *file = var_get("TJ_DIRSFILE"), *home = var_get("HOME");
+	char *path = NULL;
+	size_t size = MAX_DIRS * sizeof(struct dir_slot);
+	struct stat st;
+	void *map;
+	if (dirs != NULL) return 0;
+	if (file == NULL) {
+		if (home == NULL) return -1;
+		path = malloc(strlen(home) + sizeof(DIRS_FILE) + 1);
+		sprintf(path, "%s/%s", home, DIRS_FILE);
+		file = path;
+	}
+	dirs_fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	free(path);
+	if (dirs_fd == -1) return -1;
+	/* A new file grows to the full size with free slots */
+	if (fstat(dirs_fd, &st) == -1 ||
+		((size_t)st.st_size < size && ftruncate(dirs_fd, size) == -1) ||
+		(map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, dirs_fd,
+		0)) == MAP_FAILED) {
+		close(dirs_fd);
+		dirs_fd = -1;
+		return -1;
+	}
+	dirs = map;
+	return 0;
+}
+
+/*
+ * Counts a visit to directory path in the directory database. A new
+ * directory takes a free slot, or the slot of the lowest rank if none is
+ * free. When the ranks add up to DIRS_AGING they are all aged, and the
+ * directories that fall below one visit are dropped.
+ */
+void dirs_visit(char const *path) {
+	double total = 0;
+	int found = -1, i, lowest = 0;
+	if (strlen(path) >= sizeof(dirs->path) || dirs_open() == -1) return;
+	flock(dirs_fd, LOCK_EX);
+	for (i = 0; i < MAX_DIRS; i++) {
+		if (dirs[i].path[0] == '\0') {
+			if (dirs[lowest].path[0] != '\0') lowest = i;
+			continue;
+		}
+		total += dirs[i].rank;
+		if (strcmp(dirs[i].path, path) == 0) found = i;
+		if (dirs[lowest].path[0] != '\0' && dirs[i].rank < dirs[lowest].rank) {
+			lowest = i;
+		}
+	}
+	if (found == -1) {
+		found = lowest;
+		strcpy(dirs[found].path, path);
+		dirs[found].rank = 0;
+	}
+	dirs[found].rank += 1;
+	dirs[found].time = time(NULL);
+	if (total + 1 >= DIRS_AGING) {
+		for (i = 0; i < MAX_DIRS; i++) {
+			if ((dirs[i].rank *= 0.9) < 1) dirs[i].path[0] = '\0';
+		}
+	}
+	flock(dirs_fd, LOCK_UN);
+}
+
+/*
+ * Returns the frecency of a slot: its rank weighted by how recent the last
+ * visit was.
+ */
+double dirs_score(struct dir_slot const *slot, long now) {
+	long age = now - slot->time;
+	if (age < 3600) return slot->rank * 4;
+	if (age < 86400) return slot->rank * 2;
+	if (age < 604800) return slot->rank / 2;
+	return slot->rank / 4;
+}
+
+/*
+ * Orders directories by score, highest first.
+ */
+int compare_scores(void const *a, void const *b) {
+	struct dir_score const *x = a, *y = b;
+	if (x->score != y->score) return (x->score > y->score ? -1 : 1);
+	return x->slot - y->slot;
+}
+
+/*
+ * Changes to the directory of the highest score that has the fragments in
+ * order in its path, other than the working directory. A directory that is
+ * gone is dropped and the next best is tried. Returns 0 on success, else -1.
+ */
+int jump_dir(char const *const *frags) {
+	char const *p;
+	char target[sizeof(dirs->path)];
+	double best, score;
+	int i, j, slot;
+	long now = time(NULL);
+	struct stat st;
+	if (dirs_open() == -1) {
+		fprintf(stderr, "jump_dir: No directory database\n");
+		return -1;
+	}
+	while (1) {
+		flock(dirs_fd, LOCK_SH);
+		for (i = 0, slot = -1, best = 0; i < MAX_DIRS; i++) {
+			if (dirs[i].path[0] == '\0' || strcmp(dirs[i].path, cwd) == 0) continue;
+			for (p = dirs[i].path, j = 0; frags[j] != NULL; j++) {
+				if ((p = strstr(p, frags[j])) == NULL) break;
+				p += strlen(frags[j]);
+			}
+			if (frags[j] != NULL) continue;
+			score = dirs_score(&dirs[i], now);
+			if (slot == -1 || score > best) {
+				best = score;
+				slot = i;
+			}
+		}
+		if (slot != -1) strcpy(target, dirs[slot].path);
+		flock(dirs_fd, LOCK_UN);
+		if (slot == -1) {
+			fprintf(stderr, "jump_dir: No match\n");
+			return -1;
+		}
+		if (stat(target, &st) == 0 && S_ISDIR(st.st_mode)) break;
+		flock(dirs_fd, LOCK_EX);
+		if (strcmp(dirs[slot].path, target) == 0) dirs[slot].path[0] = '\0';
+		flock(dirs_fd, LOCK_UN);
+	}
+	return change_dir(target);
+}
+
+/*
+ * Lists the directory database by score.
+ */
+void list_dirs(void) {
+	int i, n;
+	long now = time(NULL);
+	struct dir_score scores[MAX_DIRS];
+	if (dirs_open() == -1) return;
+	flock(dirs_fd, LOCK_SH);
+	for (i = n = 0; i < MAX_DIRS; i++) {
+		if (dirs[i].path[0] == '\0') continue;
+		scores[n].score = dirs_score(&dirs[i], now);
+		scores[n++].slot = i;
+	}
+	qsort(scores, n, sizeof(struct dir_score), compare_scores);
+	for (i = 0; i < n; i++) {
+		fprintf(stdout, "%8.1f  %s\n", scores[i].score, dirs[scores[i].slot].path);
+	}
+	flock(dirs_fd, LOCK_UN);
+}
+
+/* A built-in command "checkEnv" which lists the exported variables sorted if no
+ * arguments are given to the command. If arguments are passed to the command
+ * then only the variables matching the argument, a regular expression as for
+ * grep, are listed. Everything runs in the shell, only the pager is spawned,
+ * see page(), and not even that if stdout is not a terminal.
+ *
+ * dtype const *const *var ⇒ var mutable, *var const, **var const
+ * (var is a: pointer to const-pointer to const-dtype)
+ */
+void check_env(char const *const *args) {
+	char *const *env = get_envp();
+	char **list, *text;
+	int i, n;
+	size_t len = 0;
+	regex_t re;
+	int use_re = (args[1] != NULL && strpbrk(args[1], ".[]*^$\\") != NULL);
+	if (use_re && regcomp(&re, args[1], REG_NOSUB) != 0) {
+		fprintf(stderr, "check_env: Bad pattern '%s'\n", args[1]);
+		return;
+	}
+	for (n = 0; env[n] != NULL; n++);
+	list = malloc((n + 1) * sizeof(char *));
+	/* Filter */
+	for (i = n = 0; env[i] != NULL; i++) {
+		if (args[1] == NULL ||
+			(use_re ? regexec(&re, env[i], 0, NULL, 0) == 0 :
+			strstr(env[i], args[1]) != NULL)) {
+			list[n++] = env[i];
+			len += strlen(env[i]) + 1;
+		}
+	}
+	if (use_re) regfree(&re);
+	sort_strs(list, n, 0);
+	text = malloc(len + 1);
+	for (i = 0, len = 0; i < n; i++) {
+		len += sprintf(text + len, "%s\n", list[i]);
+	}
+	if (isatty(STDOUT_FILENO)) {
+		page(text, len);
+	} else {
+		fflush(stdout);
+		write_all(STDOUT_FILENO, text, len);
+	}
+	free(text);
+	free(list);
+}
+
+/*
+ * Terminates all children in an orderly manner.
+ */
+void term_all(void) {
+	char path[STR_LEN+1];
+	DIR *dirp;
+	FILE *fp;
+	pid_t pid, ppid;
+	struct dirent* dent;
+	fprintf(stdout, "\nTJ Shell closing...\n\n");
+	if ((dirp = opendir("/proc")) == NULL) {
+		fprintf(stderr, "term_all: Could not open '/proc'\n");
+		exit(EXIT_FAILURE);
+	}
+	/* Searches through all directories in /proc */
+	while((dent = readdir(dirp)) != NULL) {
+		/* If numerical */
+		if (dent->d_name[0] >= '0' && dent->d_name[0] <= '9') {
+			/* Take data from /proc/[pid]/stat, see URL below for more info.
+			   http://man7.org/linux/man-pages/man5/proc.5.html */
+			sprintf(path, "/proc/%s/stat", dent->d_name);
+			fp = fopen(path,"r");
+			fscanf(fp, "%d %*s %*c %d", &pid, &ppid);
+			fclose(fp);
+			/* Kill if shell is parent to process */
+			if (shell_pid == ppid) if (kill(pid, SIGKILL) == -1) perror("kill");
+		}
+	}
+	closedir(dirp);
+	ten_ms_sleep(10); /* wait for SIGKILL signals to terminate bg processes */
+	sig_drain(NULL);
+	cgroup_reap();
+	exit(EXIT_SUCCESS);
+}
+
+/*------------------------------------------------------------------------------
+ * EVERY
+ */
+
+/*
+ * Runs the pipeline every job.every_ms like watch(1), job.every_count times
+ * or until q is pressed, see every_key(). Its output, stdout and stderr, is
+ * captured, and on a terminal only the lines that changed are redrawn, below
+ * a header with the run time. Elsewhere the output is printed when it
+ * changed. The runs are scheduled by a timerfd, so they do not drift, and a
+ * run longer than the interval skips the ticks it missed. Returns the number
+ * of the command that failed in the last run, or 0.
+ */
+int run_every(char *(*args)[MAX_ARGS+1], int const *no_args, int no_cmds) {
+	char *out[2] = {NULL, NULL}, *swap, title[STR_LEN+1];
+	int cap[2] = {0, 0}, failed_cmd = 0, i, keys[2], len = 0, n;
+	int tty = isatty(STDIN_FILENO) && isatty(STDOUT_FILENO);
+	int out_fd = memfd_create("tj_every", MFD_CLOEXEC);
+	long ms;
+	struct itimerspec its;
+	struct pollfd fds[2];
+	uint64_t ticks;
+	for (i = 0; i < no_args[0] && len < STR_LEN; i++) {
+		len += snprintf(title + len, STR_LEN + 1 - len, "%s%s", i ? " " : "",
+			args[0][i]);
+	}
+	for (n = 1; n < no_cmds && len < STR_LEN; n++) {
+		for (i = 0; i < no_args[n] && len < STR_LEN; i++) {
+			len += snprintf(title + len, STR_LEN + 1 - len, " %s%s",
+				i ? "" : "| ", args[n][i]);
+		}
+	}
+	/* Keys are read from a copy of the terminal, as stdin is /dev/null during
+	   the runs, and also then, see every_key() */
+	keys[0] = (tty ? fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 3) : -1);
+	keys[1] = 0; /* set when stopped */
+	fds[0].fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	fds[0].events = fds[1].events = POLLIN;
+	if (out_fd == -1 || fds[0].fd == -1 || (tty && (keys[0] == -1 ||
+		ev_add(keys[0], every_key, keys) == -1 || raw_mode(1) == -1))) {
+		fprintf(stderr, "run_every: Could not start\n");
+		if (out_fd != -1) close(out_fd);
+		if (fds[0].fd != -1) close(fds[0].fd);
+		if (keys[0] != -1) {
+			ev_del(keys[0]);
+			close(keys[0]);
+		}
+		return 1;
+	}
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = its.it_interval.tv_sec = job.every_ms / 1000;
+	its.it_value.tv_nsec = its.it_interval.tv_nsec =
+		job.every_ms % 1000 * 1000000;
+	timerfd_settime(fds[0].fd, 0, &its, NULL);
+	/* The alternate screen, left as it was when done */
+	if (tty) write_all(STDOUT_FILENO, "\x1b[?1049h", 8);
+	for (n = 1; !keys[1]; n++) {
+		ms = every_run(args, no_args, no_cmds, out_fd, &failed_cmd);
+		/* The output of the previous run is kept in out[1] to compare */
+		len = lseek(out_fd, 0, SEEK_END);
+		out[0] = grow(out[0], &cap[0], len + 1, 1);
+		len = pread(out_fd, out[0], len, 0);
+		out[0][len > 0 ? len : 0] = '\0';
+		if (tty) {
+			every_draw(title, n, ms, out[0], out[1]);
+		} else if (out[1] == NULL || strcmp(out[0], out[1]) != 0) {
+			fprintf(stdout, "Every %ld ms: %s  (run %d in %ld ms)\n%s",
+				job.every_ms, title, n, ms, out[0]);
+			fflush(stdout);
+		}
+		swap = out[0];
+		out[0] = out[1];
+		out[1] = swap;
+		i = cap[0];
+		cap[0] = cap[1];
+		cap[1] = i;
+		if (job.every_count > 0 && n == job.every_count) break;
+		/* Wait for the next tick, or a key that stops */
+		while (!keys[1]) {
+			fds[1].fd = ev_epoll;
+			if (poll(fds, 2, -1) == -1) continue;
+			if (fds[1].revents & POLLIN) ev_run_once(0);
+			if (fds[0].revents & POLLIN &&
+				read(fds[0].fd, &ticks, sizeof(ticks)) == sizeof(ticks)) {
+				break;
+			}
+		}
+	}
+	if (tty) {
+		write_all(STDOUT_FILENO, "\x1b[?1049l", 8);
+		raw_mode(0);
+		ev_del(keys[0]);
+		close(keys[0]);
+	}
+	close(fds[0].fd);
+	close(out_fd);
+	free(out[0]);
+	free(out[1]);
+	return failed_cmd;
+}
+
+/*
+ * Reads a key for run_every() from keys[0], the terminal. q, Ctrl+C and
+ * Ctrl+D stop it by setting keys[1]. The terminal is in raw mode, so Ctrl+C
+ * is sent as SIGINT to the process group of a run that is going on.
+ */
+void every_key(void *arg) {
+	char c;
+	int *keys = arg;
+	if (read(keys[0], &c, 1) != 1) return;
+	if (c == CTRL_KEY('C') && job_pgid > 0) kill(-job_pgid, SIGINT);
+	if (c == 'q' || c == CTRL_KEY('C') || c == CTRL_KEY('D')) keys[1] = 1;
+}
+
+/*
+ * Runs the pipeline once for run_every(), with stdin from /dev/null and
+ * stdout and stderr to out_fd, which is emptied first. The commands are run
+ * as in a script, in a process group of their own, see job_pgrp(), and the
+ * shell keeps the terminal. Returns the run time in ms.
+ */
+long every_run(char *(*args)[MAX_ARGS+1], int const *no_args, int no_cmds,
+	int out_fd, int *failed_cmd) {
+	int i, null_fd, saved[3], was_interactive = interactive;
+	struct timeval t0, t1;
+	if (ftruncate(out_fd, 0) == -1 || lseek(out_fd, 0, SEEK_SET) == -1) {
+		*failed_cmd = 1;
+		return 0;
+	}
+	fflush(stdout);
+	fflush(stderr);
+	null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	for (i = 0; i < 3; i++) {
+		saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 3);
+		dup2(i == 0 ? null_fd : out_fd, i);
+	}
+	if (null_fd != -1) close(null_fd);
+	interactive = 0;
+	gettimeofday(&t0, NULL);
+	*failed_cmd = exec_job(args, no_args, no_cmds);
+	job_pgid = 0;
+	gettimeofday(&t1, NULL);
+	interactive = was_interactive;
+	fflush(stdout);
+	fflush(stderr);
+	for (i = 0; i < 3; i++) {
+		dup2(saved[i], i);
+		close(saved[i]);
+	}
+	last_runtime = (t1.tv_sec - t0.tv_sec) * 1000 +
+		(t1.tv_usec - t0.tv_usec) / 1000;
+	return last_runtime;
+}
+
+/*
+ * Draws out, the output of run n of title that took ms, on the alternate
+ * screen. Only the lines that differ from prev, the output drawn before, are
+ * redrawn, all of them if prev is NULL or the terminal was resized. Lines are
+ * cut at the width of the terminal.
+ */
+void every_draw(char const *title, int n, long ms, char const *out,
+	char const *prev) {
+	static char *frame = NULL;
+	static int cap = 0, rows = 24, cols = 80;
+	char const *p = out, *q = prev, *p_end, *q_end;
+	char head[STR_LEN+128];
+	int full = (prev == NULL), len, row, size;
+	struct winsize ws;
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 0 &&
+		ws.ws_col > 0 && (ws.ws_row != rows || ws.ws_col != cols)) {
+		rows = ws.ws_row;
+		cols = ws.ws_col;
+		full = 1;
+	}
+	if (full) q = "";
+	/* The header, then the output from the third row */
+	len = sprintf(head, "Every %ld ms: %s  (run %d in %ld ms)", job.every_ms,
+		title, n, ms);
+	frame = grow(frame, &cap, len + 32, 1);
+	size = sprintf(frame, "%s\x1b[H%.*s\x1b[K", full ? "\x1b[2J" : "",
+		fit_columns(head, len, cols), head);
+	for (row = 3; row <= rows && (*p != '\0' || *q != '\0'); row++) {
+		if ((p_end = strchr(p, '\n')) == NULL) p_end = p + strlen(p);
+		if ((q_end = strchr(q, '\n')) == NULL) q_end = q + strlen(q);
+		if (full || p_end - p != q_end - q || memcmp(p, q, p_end - p) != 0) {
+			len = fit_columns(p, p_end - p, cols);
+			frame = grow(frame, &cap, size + len + 32, 1);
+			size += sprintf(frame + size, "\x1b[%d;1H%.*s\x1b[K", row, len, p);
+		}
+		p = (*p_end == '\0' ? p_end : p_end + 1);
+		q = (*q_end == '\0' ? q_end : q_end + 1);
+	}
+	write_all(STDOUT_FILENO, frame, size);
+}
+
+/*------------------------------------------------------------------------------
+ * ONCHANGE
+ *
+ * onchange runs a pipeline again each time one of its paths changes, as a
+ * loop that rebuilds or tests on save. The paths are watched with inotify in
+ * the event loop, so a change seen while the pipeline runs cancels that run.
+ * Directories are watched for their entries, not recursively.
+ */
+
+/*
+ * Runs the pipeline, and again after each change of the paths in
+ * job.watches until q is pressed or none of them is left. Changes that come
+ * in a burst, within DEBOUNCE ms of each other, make one run. Returns the
+ * number of the command that failed in the last run, or 0.
+ */
+int run_onchange(char *(*args)[MAX_ARGS+1], int const *no_args, int no_cmds) {
+	char c;
+	int failed_cmd = 0, quit = 0, tty = isatty(STDIN_FILENO);
+	struct pollfd fds[2], watch;
+	if (ev_add(job.watch_fd, watch_event, NULL) == -1) {
+		perror("run_onchange");
+		return 1;
+	}
+	watch.fd = job.watch_fd;
+	fds[0].fd = (tty ? STDIN_FILENO : -1);
+	fds[1].fd = ev_epoll;
+	watch.events = fds[0].events = fds[1].events = POLLIN;
+	while (!quit) {
+		job.changed = NULL;
+		failed_cmd = exec_job(args, no_args, no_cmds);
+		/* Wait for a change, q or Ctrl+C stops */
+		if (tty && raw_mode(1) == -1) fds[0].fd = -1;
+		while (job.changed == NULL && !quit) {
+			if (poll(fds, 2, -1) == -1) continue;
+			if (fds[1].revents & POLLIN) ev_run_once(0);
+			if (fds[0].revents & POLLIN && read(STDIN_FILENO, &c, 1) == 1 &&
+				(c == 'q' || c == CTRL_KEY('C') || c == CTRL_KEY('D'))) {
+				quit = 1;
+			}
+		}
+		if (fds[0].fd != -1) raw_mode(0);
+		/* Let the burst settle, then watch again files that were replaced */
+		while (!quit && poll(&watch, 1, DEBOUNCE) == 1) watch_event(NULL);
+		if (!quit && watch_paths() == 0) {
+			fprintf(stderr, "run_onchange: Nothing left to watch\n");
+			quit = 1;
+		}
+		if (!quit && interactive) {
+			fprintf(stdout, "[onchange] %s changed\n", job.changed);
+		}
+	}
+	ev_del(job.watch_fd);
+	return failed_cmd;
+}
+
+/*
+ * Takes the events of the watched paths, and cancels the run of the
+ * pipeline if one is going.
+ */
+void watch_event(void *arg) {
+	char buf[4096];
+	int i;
+	ssize_t len, n;
+	struct inotify_event *e;
+	while ((len = read(job.watch_fd, buf, sizeof(buf))) > 0) {
+		for (n = 0; n < len; n += sizeof(struct inotify_event) + e->len) {
+			e = (struct inotify_event *)(buf + n);
+			for (i = 0; i < job.no_watches; i++) {
+				if (job.watches[i].wd != e->wd) continue;
+				/* A path is watched, not the file that was moved away */
+				if (e->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+					inotify_rm_watch(job.watch_fd, e->wd);
+				}
+				if (e->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+					job.watches[i].wd = -1;
+				}
+				job.changed = job.watches[i].path;
+			}
+		}
+	}
+	if (job.changed != NULL && job_timer != NULL) timer_cancel(job_timer);
+}
+
+/*
+ * Watches the paths in job.watches that are not watched. Returns the number
+ * of paths that are watched.
+ */
+int watch_paths(void) {
+	int i, watched = 0;
+	for (i = 0; i < job.no_watches; i++) {
+		if (job.watches[i].wd == -1) {
+			job.watches[i].wd = inotify_add_watch(job.watch_fd,
+				job.watches[i].path, WATCH_EVENTS);
+		}
+		if (job.watches[i].wd != -1) watched++;
+	}
+	return watched;
+}
+
+/*------------------------------------------------------------------------------
+ * EVENTS
+ *
+ * The event loop watches file descriptors with epoll and runs their
+ * functions while the shell waits, at the prompt of the line editor and for
+ * foreground jobs, see wait_events(). Timeouts of jobs are timerfds in it.
+ */
+
+/*
+ * Watches fd, fn is called with arg when it is readable. Returns 0 on
+ * success, else -1.
+ */
+int ev_add(int fd, void (*fn)(void *), void *arg) {
+	int i;
+	struct epoll_event e;
+	struct event *ev;
+	if (ev_epoll == -1 && (ev_epoll = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		return -1;
+	}
+	ev = malloc(sizeof(struct event));
+	ev->fd = fd;
+	ev->fn = fn;
+	ev->arg = arg;
+	memset(&e, 0, sizeof(e));
+	e.events = EPOLLIN;
+	e.data.ptr = ev;
+	if (epoll_ctl(ev_epoll, EPOLL_CTL_ADD, fd, &e) == -1) {
+		free(ev);
+		return -1;
+	}
+	if (fd >= ev_cap) {
+		i = ev_cap;
+		events = grow(events, &ev_cap, fd + 1, sizeof(struct event *));
+		while (i < ev_cap) events[i++] = NULL;
+	}
+	events[fd] = ev;
+	no_events++;
+	return 0;
+}
+
+/*
+ * Stops watching fd.
+ */
+void ev_del(int fd) {
+	if (fd < 0 || fd >= ev_cap || events[fd] == NULL) return;
+	epoll_ctl(ev_epoll, EPOLL_CTL_DEL, fd, NULL);
+	free(events[fd]);
+	events[fd] = NULL;
+	no_events--;
+}
+
+/*
+ * Runs the function of one readable file descriptor, waiting up to timeout
+ * ms for one, or forever if timeout is -1. One at a time, so that a function
+ * may remove other events. Returns 1 if a function ran, else 0.
+ */
+int ev_run_once(int timeout) {
+	struct epoll_event e;
+	struct event *ev;
+	if (ev_epoll == -1 || epoll_wait(ev_epoll, &e, 1, timeout) != 1) return 0;
+	ev = e.data.ptr;
+	ev->fn(ev->arg);
+	return 1;
+}
+
+/*
+ * Sets the int that arg points to, for an event that only has to be noticed.
+ */
+void ev_flag(void *arg) {
+	*(int *)arg = 1;
+}
+
+/*
+ * Starts a timeout of ms for the job being started, its processes are added
+ * by timer_add() as they are spawned. Returns the timer, or NULL if it could
+ * not be started.
+ */
+struct timer *timer_start(long ms) {
+	struct timer *t = malloc(sizeof(struct timer));
+	t->fired = t->cancelled = t->no_pids = 0;
+	t->held = 1;
+	t->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (t->fd == -1 || ev_add(t->fd, timer_fire, t) == -1) {
+		perror("timer_start");
+		if (t->fd != -1) close(t->fd);
+		free(t);
+		return NULL;
+	}
+	timer_arm(t->fd, ms);
+	t->next = timers;
+	timers = t;
+	return t;
+}
+
+/*
+ * Arms timerfd fd to expire once after ms.
+ */
+void timer_arm(int fd, long ms) {
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = ms % 1000 * 1000000;
+	timerfd_settime(fd, 0, &its, NULL);
+}
+
+/*
+ * Adds process pid in process group pgid to timer t, unless t is NULL.
+ */
+void timer_add(struct timer *t, pid_t pid, pid_t pgid) {
+	if (t == NULL || t->no_pids == MAX_CMDS) return;
+	t->pids[t->no_pids] = pid;
+	t->pgids[t->no_pids++] = pgid;
+}
+
+/*
+ * Called when timer t expires, sends SIGTERM to the job, or SIGKILL if that
+ * was TIMEOUT_GRACE ago. The process groups are signalled, timed children
+ * are in groups of their own also in scripts, see job_pgrp().
+ */
+void timer_fire(void *arg) {
+	int alive = 0, i, sig;
+	pid_t target;
+	struct timer *t = arg;
+	uint64_t expirations;
+	if (read(t->fd, &expirations, sizeof(expirations)) == -1) return;
+	sig = (t->fired ? SIGKILL : SIGTERM);
+	for (i = 0; i < t->no_pids; i++) {
+		/* A child that has not made its group yet is signalled alone */
+		target = -t->pgids[i];
+		if (kill(target, sig) == -1) target = t->pids[i];
+		if (target < 0 || kill(target, sig) == 0) alive = 1;
+		/* A stopped job has to run to terminate */
+		if (sig == SIGTERM) kill(target, SIGCONT);
+	}
+	if (alive && !t->fired) {
+		timer_arm(t->fd, TIMEOUT_GRACE);
+	} else {
+		ev_del(t->fd);
+		close(t->fd);
+		t->fd = -1;
+	}
+	t->fired = 1;
+}
+
+/*
+ * Terminates the job of timer t now as timer_fire() does, but without it
+ * being reported as timed out.
+ */
+void timer_cancel(struct timer *t) {
+	if (t->fd == -1 || t->fired) return;
+	t->cancelled = 1;
+	timer_arm(t->fd, 1);
+}
+
+/*
+ * Forgets reaped process pid in the timers. Returns 1 if it was terminated
+ * by its timeout, else 0.
+ */
+int timer_reaped(pid_t pid) {
+	int i;
+	struct timer *t;
+	for (t = timers; t != NULL; t = t->next) {
+		for (i = 0; i < t->no_pids; i++) {
+			if (t->pids[i] != pid) continue;
+			t->no_pids--;
+			t->pids[i] = t->pids[t->no_pids];
+			t->pgids[i] = t->pgids[t->no_pids];
+			return t->fired && !t->cancelled;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Frees the timers of jobs that are done, or that are disarmed.
+ */
+void timers_collect(void) {
+	struct timer **t = &timers, *done;
+	while (*t != NULL) {
+		if ((*t)->held || ((*t)->no_pids > 0 && (*t)->fd != -1)) {
+			t = &(*t)->next;
+			continue;
+		}
+		done = *t;
+		*t = done->next;
+		if (done->fd != -1) {
+			ev_del(done->fd);
+			close(done->fd);
+		}
+		free(done);
+	}
+}
+
+/*
+ * Returns duration s in ms, or -1 if it is bad. It is a number of seconds,
+ * or of ms, m or h with that suffix.
+ */
+long parse_duration(char const *s) {
+	char *end;
+	double n = strtod(s, &end);
+	if (end == s || n < 0) return -1;
+	if (strcmp(end, "") == 0 || strcmp(end, "s") == 0) return n * 1000;
+	if (strcmp(end, "ms") == 0) return n;
+	if (strcmp(end, "m") == 0) return n * 60000;
+	if (strcmp(end, "h") == 0) return n * 3600000;
+	return -1;
+}
+
+/*------------------------------------------------------------------------------
+ * CGROUPS
+ *
+ * A job with a memory or CPU bandwidth limit runs in a cgroup of its own,
+ * next to the shell in the cgroup v2 hierarchy, so that a runaway job is
+ * stopped by the kernel before it takes the session down. The cgroup is
+ * removed, and what the job used is reported, once the job is done.
+ */
+
+/*
+ * Finds the cgroup of the shell, where the cgroups of jobs are made, and
+ * enables the memory and cpu controllers for them. A cgroup with enabled
+ * controllers cannot have processes of its own, so the shell and the zygote
+ * move to a leaf cgroup first. Returns 0 if jobs can get cgroups, else -1.
+ */
+int cgroup_init(void) {
+	char const *enable = "+memory +cpu";
+	char line[PATH_MAX], *leaf, pid[16];
+	FILE *file;
+	if (cgroup_tried) return (cgroup_base == NULL ? -1 : 0);
+	cgroup_tried = 1;
+	if ((file = fopen("/proc/self/cgroup", "r")) == NULL) return -1;
+	while (fgets(line, sizeof(line), file) != NULL &&
+		strncmp(line, "0::/", 4) != 0);
+	fclose(file);
+	if (strncmp(line, "0::/", 4) != 0) return -1;
+	line[strcspn(line, "\n")] = '\0';
+	cgroup_base = malloc(sizeof(CGROUP_ROOT) + strlen(line));
+	sprintf(cgroup_base, "%s%s", CGROUP_ROOT, line + 3);
+	if (cgroup_read(cgroup_base, "cgroup.controllers", "memory") == -1 ||
+		cgroup_read(cgroup_base, "cgroup.controllers", "cpu") == -1) {
+		free(cgroup_base);
+		cgroup_base = NULL;
+		return -1;
+	}
+	if (cgroup_write(cgroup_base, "cgroup.subtree_control", enable) == 0) {
+		return 0;
+	}
+	leaf = malloc(strlen(cgroup_base) + 32);
+	sprintf(leaf, "%s/tj-%d", cgroup_base, shell_pid);
+	sprintf(pid, "%d", shell_pid);
+	if (mkdir(leaf, 0755) == 0 && cgroup_write(leaf, "cgroup.procs", pid) == 0) {
+		sprintf(pid, "%d", zygote_pid);
+		if ((zygote_pid == -1 || cgroup_write(leaf, "cgroup.procs", pid) == 0) &&
+			cgroup_write(cgroup_base, "cgroup.subtree_control", enable) == 0) {
+			free(leaf);
+			return 0;
+		}
+		/* Other processes share the cgroup of the shell, move back */
+		if (zygote_pid != -1) cgroup_write(cgroup_base, "cgroup.procs", pid);
+		sprintf(pid, "%d", shell_pid);
+		cgroup_write(cgroup_base, "cgroup.procs", pid);
+	}
+	rmdir(leaf);
+	free(leaf);
+	free(cgroup_base);
+	cgroup_base = NULL;
+	return -1;
+}
+
+/*
+ * Makes a cgroup for the running job if it has a memory or CPU bandwidth
+ * limit. Returns the open directory of the cgroup, or -1 if there is none.
+ */
+int cgroup_create(void) {
+	char *dir, value[64];
+	int fd = -1;
+	struct job_cgroup *cg;
+	if ((job.mem_mb == 0 && job.cpu_pct == 0) || cgroup_init() == -1) return -1;
+	dir = malloc(strlen(cgroup_base) + 32);
+	sprintf(dir, "%s/tj-%d.%d", cgroup_base, shell_pid, ++no_job_cgroups);
+	if (mkdir(dir, 0755) == -1) {
+		free(dir);
+		return -1;
+	}
+	sprintf(value, "%lu", (unsigned long)job.mem_mb << 20);
+	if (job.mem_mb == 0 || cgroup_write(dir, "memory.max", value) == 0) {
+		sprintf(value, "%ld %d", (long)job.cpu_pct * (CPU_PERIOD / 100),
+			CPU_PERIOD);
+		if (job.cpu_pct == 0 || cgroup_write(dir, "cpu.max", value) == 0) {
+			fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		}
+	}
+	if (fd == -1) {
+		fprintf(stderr, "cgroup_create: Could not limit the job in '%s'\n", dir);
+		rmdir(dir);
+		free(dir);
+		return -1;
+	}
+	cg = malloc(sizeof(struct job_cgroup));
+	cg->path = dir;
+	cg->next = job_cgroups;
+	job_cgroups = cg;
+	return fd;
+}
+
+/*
+ * Removes the cgroups of jobs that are done, reporting the peak memory and
+ * the CPU time of each job.
+ */
+void cgroup_reap(void) {
+	long peak, usage;
+	struct job_cgroup **cg = &job_cgroups, *done;
+	while (*cg != NULL) {
+		if (cgroup_read((*cg)->path, "cgroup.events", "populated") != 0) {
+			cg = &(*cg)->next;
+			continue;
+		}
+		peak = cgroup_read((*cg)->path, "memory.peak", NULL);
+		usage = cgroup_read((*cg)->path, "cpu.stat", "usage_usec");
+		if (interactive) {
+			fprintf(stdout, "[%s] ", strrchr((*cg)->path, '/') + 1);
+			if (peak != -1) {
+				fprintf(stdout, "Memory peak %.1f MB, ", peak / 1048576.0);
+			}
+			fprintf(stdout, "CPU time %.2f s\n", usage / 1000000.0);
+		}
+		rmdir((*cg)->path);
+		done = *cg;
+		*cg = done->next;
+		free(done->path);
+		free(done);
+	}
+}
+
+/*
+ * Writes value to file name in cgroup directory dir. Returns 0 on success,
+ * else -1.
+ */
+int cgroup_write(char const *dir, char const *name, char const *value) {
+	char path[PATH_MAX];
+	int fd, failed;
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if ((fd = open(path, O_WRONLY | O_CLOEXEC)) == -1) return -1;
+	failed = write_all(fd, value, strlen(value));
+	close(fd);
+	return failed;
+}
+
+/*
+ * Reads file name in cgroup directory dir, a list of keys with values or of
+ * keys, or a single value if key is NULL. Returns the value of key, 0 if key
+ * has no value, or -1 if it is missing.
+ */
+long cgroup_read(char const *dir, char const *name, char const *key) {
+	char path[PATH_MAX], word[64];
+	long value = -1;
+	FILE *file;
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if ((file = fopen(path, "r")) == NULL) return -1;
+	if (key == NULL) {
+		if (fscanf(file, "%ld", &value) != 1) value = -1;
+	} else {
+		while (fscanf(file, "%63s", word) == 1) {
+			if (strcmp(word, key) != 0) continue;
+			if (fscanf(file, "%ld", &value) != 1) value = 0;
+			break;
+		}
+	}
+	fclose(file);
+	return value;
+}
+
+/*------------------------------------------------------------------------------
+ * DAEMON
+ *
+ * With -d the shell stays resident and serves tj_client on a Unix socket.
+ * Each request, the arguments of a shell with the working directory,
+ * environment and stdin, stdout and stderr of the client, is run by a
+ * session forked from the daemon. A session starts with the commands in
+ * PATH already found and none of the startup of a new shell, and the exit
+ * status of the session is the answer to the client.
+ *
+ * Everything is driven by the event loop: the socket, the connections and a
+ * pidfd per session, so that thousands of sessions cost no more than their
+ * file descriptors. At most TJ_SESSIONS sessions run at once, by default
+ * SESSIONS_PER_CPU per CPU, which all clients share. The others are queued
+ * by owner, the process a client runs for, and the owners take turns, so
+ * that a tool that sends many requests does not hold up one that sends few.
+ */
+
+/*
+ * Serves requests on the socket in HOME, or the one named by TJ_SOCKET, until
+ * killed. Returns EXIT_FAILURE if the socket could not be set up.
+ */
+int serve(void) {
+	char const *file = var_get("TJ_SOCKET"), *home = var_get("HOME");
+	char const *max = var_get("TJ_SESSIONS");
+	char *path = NULL;
+	mode_t mask;
+	sigset_t set;
+	struct sockaddr_un addr;
+	if (file == NULL) {
+		if (home == NULL) return EXIT_FAILURE;
+		path = malloc(strlen(home) + sizeof(SOCKET_FILE) + 1);
+		sprintf(path, "%s/%s", home, SOCKET_FILE);
+		file = path;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(file) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "serve: Socket path too long\n");
+		return EXIT_FAILURE;
+	}
+	strcpy(addr.sun_path, file);
+	free(path);
+	if ((max_running = (max != NULL ? atoi(max) : 0)) <= 0) {
+		max_running = SESSIONS_PER_CPU * sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	/* A socket left by a daemon that is gone is replaced */
+	server_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (server_fd != -1 &&
+		connect(server_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+		fprintf(stderr, "serve: Already served on '%s'\n", addr.sun_path);
+		return EXIT_FAILURE;
+	}
+	if (server_fd != -1) close(server_fd);
+	unlink(addr.sun_path);
+	mask = umask(077);
+	server_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (server_fd == -1 ||
+		bind(server_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+		listen(server_fd, SOMAXCONN) == -1 ||
+		ev_add(server_fd, serve_conn, NULL) == -1) {
+		perror("serve");
+		return EXIT_FAILURE;
+	}
+	umask(mask);
+	/* Sessions are reaped by their pidfds, not by the SIGCHLD handler */
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &set, NULL);
+	warm_commands();
+	while (1) ev_run_once(-1);
+}
+
+/*
+ * Called when the socket of the daemon, or of session arg, is readable. A new
+ * client is accepted, the request of a client queues its session, and a
+ * client that hangs up before its session is done has it hung up too.
+ */
+void serve_conn(void *arg) {
+	socklen_t cred_len = sizeof(struct ucred);
+	struct session *s = arg, *prev = NULL, **q;
+	struct ucred cred;
+	if (s == NULL) {
+		/* Only clients of the same user */
+		s = calloc(1, sizeof(struct session));
+		s->pidfd = -1;
+		if ((s->conn = accept4(server_fd, NULL, NULL, SOCK_CLOEXEC)) == -1 ||
+			getsockopt(s->conn, SOL_SOCKET, SO_PEERCRED, &cred,
+			&cred_len) == -1 || cred.uid != getuid() ||
+			ev_add(s->conn, serve_conn, s) == -1) {
+			if (s->conn != -1) close(s->conn);
+			free(s);
+			return;
+		}
+		s->watched = 1;
+		/* From the kernel, as a client could claim any owner */
+		s->runs_for = parent_pid(cred.pid);
+		return;
+	}
+	if (s->pid != 0) {
+		kill(-s->pid, SIGHUP);
+		ev_del(s->conn);
+		s->watched = 0;
+	} else if (s->owner != NULL) {
+		/* Gone before its turn */
+		for (q = &s->owner->queue; *q != s; q = &(*q)->next) prev = *q;
+		*q = s->next;
+		if (s->owner->last == s) s->owner->last = prev;
+		session_end(s);
+	} else if (serve_request(s) == -1) {
+		s->pid = -1;
+		send(s->conn, &s->pid, sizeof(pid_t), MSG_NOSIGNAL);
+		session_end(s);
+	} else {
+		serve_next();
+	}
+}
+
+/*
+ * Reads the request of session s and queues it at its owner. Returns 0 on
+ * success, 1 if the request has not come yet, else -1.
+ */
+int serve_request(struct session *s) {
+	static char buf[CLIENT_MAX+1];
+	char cbuf[CMSG_SPACE(3 * sizeof(int))];
+	int i, no_fds = 0, no_strs = 0;
+	ssize_t len;
+	struct client_request *req = (struct client_request *)buf;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	struct msghdr msg;
+	struct owner *o;
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = CLIENT_MAX;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	len = recvmsg(s->conn, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+	if (len == -1 && (errno == EAGAIN || errno == EINTR)) return 1;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg != NULL && cmsg->cmsg_type == SCM_RIGHTS) {
+		no_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(s->fds, CMSG_DATA(cmsg), no_fds * sizeof(int));
+	}
+	/* Count the strings, there has to be one for each of the request */
+	if (len >= (ssize_t)sizeof(*req)) {
+		buf[len] = '\0';
+		for (i = sizeof(*req); i < len; i += strlen(buf + i) + 1) no_strs++;
+	}
+	if (no_fds != 3 || (msg.msg_flags & MSG_TRUNC) || req->no_args <= 0 ||
+		req->no_env < 0 || no_strs < 1 + req->no_args + req->no_env) {
+		for (i = 0; i < no_fds; i++) close(s->fds[i]);
+		return -1;
+	}
+	s->req = malloc(len + 1);
+	memcpy(s->req, buf, len + 1);
+	/* Queue it at its owner, which joins the ring if it is new */
+	for (o = owner_turn; o != NULL; o = o->next) {
+		if (o->pid == s->runs_for || o->next == owner_turn) break;
+	}
+	if (o != NULL && o->pid != s->runs_for) o = NULL;
+	if (o == NULL) {
+		o = calloc(1, sizeof(struct owner));
+		o->pid = s->runs_for;
+		if (owner_turn == NULL) {
+			o->next = o;
+			owner_turn = o;
+		} else {
+			o->next = owner_turn->next;
+			owner_turn->next = o;
+		}
+	}
+	if (o->last != NULL) {
+		o->last->next = s;
+	} else {
+		o->queue = s;
+	}
+	o->last = s;
+	o->no_sessions++;
+	s->owner = o;
+	return 0;
+}
+
+/*
+ * Starts queued sessions while fewer than max_running run, one of each owner
+ * in turn.
+ */
+void serve_next(void) {
+	int i;
+	struct owner *o;
+	struct session *s;
+	while (no_running < max_running && owner_turn != NULL) {
+		/* The next owner in the ring with a queued session */
+		for (o = owner_turn->next; o->queue == NULL && o != owner_turn;
+			o = o->next);
+		if ((s = o->queue) == NULL) return;
+		owner_turn = o;
+		if ((o->queue = s->next) == NULL) o->last = NULL;
+		s->next = NULL;
+		/* A command installed since is found, a stat() per directory */
+		warm_commands();
+		if ((s->pid = fork()) == 0) {
+			serve_session((struct client_request *)s->req, s->fds);
+		}
+		for (i = 0; i < 3; i++) close(s->fds[i]);
+		free(s->req);
+		s->req = NULL;
+		if (s->pid != -1 &&
+			((s->pidfd = syscall(SYS_pidfd_open, s->pid, 0)) == -1 ||
+			ev_add(s->pidfd, serve_reap, s) == -1)) {
+			kill(-s->pid, SIGKILL);
+			kill(s->pid, SIGKILL);
+			waitpid(s->pid, NULL, 0);
+			s->pid = -1;
+		}
+		send(s->conn, &s->pid, sizeof(pid_t), MSG_NOSIGNAL);
+		if (s->pid == -1) {
+			session_end(s);
+			continue;
+		}
+		no_running++;
+	}
+}
+
+/*
+ * Called when session arg is done, answers its client with the exit status
+ * and starts the next one.
+ */
+void serve_reap(void *arg) {
+	int status;
+	struct session *s = arg;
+	if (waitpid(s->pid, &status, WNOHANG) <= 0) return;
+	status = (WIFSIGNALED(status) ? 128 + WTERMSIG(status) :
+		WEXITSTATUS(status));
+	send(s->conn, &status, sizeof(status), MSG_NOSIGNAL);
+	no_running--;
+	session_end(s);
+	serve_next();
+}
+
+/*
+ * The session, runs request req with fds as stdin, stdout and stderr and
+ * exits with its status. It is the leader of a new session without a
+ * terminal, which the client signals as a process group.
+ */
+void serve_session(struct client_request const *req, int const *fds) {
+	char *dir = (char *)(req + 1), *p, **args, **env;
+	int i;
+	sigset_t set;
+	struct owner *o = owner_turn;
+	struct session *s;
+	setsid();
+	/* Leave the daemon behind: its sockets, event loop and signals, and the
+	   connections and files of the other clients, or they would not see
+	   their files closed until this session is done */
+	while (o != NULL) {
+		for (s = o->queue; s != NULL; s = s->next) {
+			for (i = 0; i < 3; i++) close(s->fds[i]);
+		}
+		o = (o->next == owner_turn ? NULL : o->next);
+	}
+	close(ev_epoll);
+	ev_epoll = -1;
+	for (i = 0; i < ev_cap; i++) {
+		if (events[i] == NULL) continue;
+		/* A running session is watched by its pidfd, maybe not by its conn */
+		if (events[i]->fn == serve_reap) {
+			close(((struct session *)events[i]->arg)->conn);
+		}
+		if (i > STDERR_FILENO && i != fds[0] && i != fds[1] && i != fds[2]) {
+			close(i);
+		}
+		free(events[i]);
+		events[i] = NULL;
+	}
+	no_events = 0;
+	close(sig_pipe[WRITE_END]);
+	sig_init();
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	sigprocmask(SIG_UNBLOCK, &set, NULL);
+	for (i = 0; i < 3; i++) {
+		if (dup2(fds[i], i) == -1) _exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < 3; i++) {
+		if (fds[i] > STDERR_FILENO) close(fds[i]);
+	}
+	args = malloc((req->no_args + req->no_env + 2) * sizeof(char *));
+	env = args + req->no_args + 1;
+	p = dir + strlen(dir) + 1;
+	for (i = 0; i < req->no_args; i++, p += strlen(p) + 1) args[i] = p;
+	args[i] = NULL;
+	for (i = 0; i < req->no_env; i++, p += strlen(p) + 1) env[i] = p;
+	env[i] = NULL;
+	if (chdir(dir) == -1) {
+		fprintf(stderr, "serve_session: Could not change to '%s'\n", dir);
+		exit(EXIT_FAILURE);
+	}
+	vars_import(env);
+	free(cwd);
+	cwd = NULL;
+	cwd_init();
+	shell_pid = getpid();
+	exit(run_args(req->no_args, args));
+}
+
+/*
+ * Closes the connection of session s and forgets it, and its owner when that
+ * has no other sessions.
+ */
+void session_end(struct session *s) {
+	struct owner *o = s->owner, *prev;
+	if (s->watched) ev_del(s->conn);
+	close(s->conn);
+	if (s->pidfd != -1) {
+		ev_del(s->pidfd);
+		close(s->pidfd);
+	}
+	if (s->req != NULL) {
+		close(s->fds[0]);
+		close(s->fds[1]);
+		close(s->fds[2]);
+		free(s->req);
+	}
+	free(s);
+	if (o == NULL || --o->no_sessions > 0) return;
+	for (prev = o; prev->next != o; prev = prev->next);
+	prev->next = o->next;
+	if (owner_turn == o) owner_turn = (prev == o ? NULL : prev);
+	free(o);
+}
+
+/*
+ * Returns the parent of process pid, read from /proc/pid/stat, or pid itself
+ * if it cannot be read.
+ */
+pid_t parent_pid(pid_t pid) {
+	char buf[STR_LEN+1], path[64], *p;
+	int fd, len, ppid;
+	sprintf(path, "/proc/%d/stat", (int)pid);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) return pid;
+	len = read(fd, buf, STR_LEN);
+	close(fd);
+	buf[len > 0 ? len : 0] = '\0';
+	/* After the command name in parentheses, which may hold any of them */
+	p = strrchr(buf, ')');
+	if (p == NULL || sscanf(p + 1, " %*c %d", &ppid) != 1) return pid;
+	return ppid;
+}
+
+/*
+ * Finds the paths of all commands in PATH, again when a directory of it has
+ * changed since, so that the sessions start with them. Called before each
+ * session is forked. Not done if PATH has a relative directory, as the
+ * sessions run in other directories.
+ */
+void warm_commands(void) {
+	static time_t scanned = 0;
+	char const *end, *path = var_get("PATH"), *p;
+	char *dir;
+	int changed = 0, pass;
+	time_t now = time(NULL);
+	DIR *dirp;
+	struct dirent *dent;
+	struct stat st;
+	if (path == NULL) return;
+	for (pass = 0; pass < 2; pass++) {
+		for (p = path; p != NULL; p = (*end == '\0' ? NULL : end + 1)) {
+			end = p + strcspn(p, ":");
+			if (*p != '/') return;
+			dir = malloc(end - p + 1);
+			sprintf(dir, "%.*s", (int)(end - p), p);
+			if (pass == 0 && stat(dir, &st) == 0 && st.st_mtime >= scanned) {
+				changed = 1;
+			}
+			if (pass == 1 && (dirp = opendir(dir)) != NULL) {
+				while ((dent = readdir(dirp)) != NULL) {
+					if (dent->d_name[0] != '.') find_command(dent->d_name, NULL);
+				}
+				closedir(dirp);
+			}
+			free(dir);
+		}
+		if (!changed) return;
+		if (pass == 0) forget_commands();
+	}
+	scanned = now;
+}
+
+/*------------------------------------------------------------------------------
+ * VARIABLES
+ *
+ * Shell variables live in a hash table. Exported variables are passed to
+ * commands in envp, which is only rebuilt after an exported variable changed.
+ */
+
+/*
+ * Imports the environment of the shell as exported variables.
+ */
+void vars_init(void) {
+	extern char **environ;
+	char *eq, *name, **env;
+	for (env = environ; *env != NULL; env++) {
+		if ((eq = strchr(*env, '=')) == NULL) continue;
+		malloc_strcpy(&name, *env);
+		name[eq - *env] = '\0';
+		var_set(name, eq + 1, 1);
+		free(name);
+	}
+}
+
+/*
+ * Replaces the variables with environment env, as in a new shell. The found
+ * paths of commands are kept if PATH stays the same.
+ */
+void vars_import(char **env) {
+	extern char **environ;
+	int i, path = 0;
+	struct var **var, *gone;
+	for (i = 0; i < VAR_BUCKETS; i++) {
+		for (var = &vars[i]; *var != NULL; ) {
+			if (strcmp((*var)->name, "PATH") == 0) {
+				var = &(*var)->next;
+				continue;
+			}
+			gone = *var;
+			*var = gone->next;
+			free(gone->name);
+			free(gone->value);
+			free(gone);
+		}
+	}
+	envp_dirty = 1;
+	environ = env;
+	vars_init();
+	for (i = 0; env[i] != NULL; i++) {
+		if (strncmp(env[i], "PATH=", 5) == 0) path = 1;
+	}
+	if (!path) var_unset("PATH");
+}
+
+/*
+ * Returns the entry for name in table, or NULL if none. If create is set a
+ * missing entry is added with a NULL value.
+ */
+struct var *var_lookup(struct var **table, char const *name, int create) {
+	struct var **bucket, *var;
+	bucket = &table[fnv1a(name, strlen(name), 0) & (VAR_BUCKETS - 1)];
+	for (var = *bucket; var != NULL; var = var->next) {
+		if (strcmp(var->name, name) == 0) return var;
+	}
+	if (!create) return NULL;
+	var = calloc(1, sizeof(struct var));
+	malloc_strcpy(&var->name, name);
+	var->next = *bucket;
+	*bucket = var;
+	return var;
+}
+
+/*
+ * Returns the value of variable name, or NULL if unset.
+ */
+char const *var_get(char const *name) {
+	struct var *var = var_lookup(vars, name, 0);
+	return (var == NULL ? NULL : var->value);
+}
+
+/*
+ * Sets variable name to value. It is exported if exported is 1, not exported
+ * if 0, and keeps its state (new variables are not exported) if -1.
+ */
+void var_set(char const *name, char const *value, int exported) {
+	struct var *var = var_lookup(vars, name, 1);
+	char *old = var->value;
+	if (exported != -1) {
+		if (var->exported != exported) envp_dirty = 1;
+		var->exported = exported;
+	}
+	if (var->exported) envp_dirty = 1;
+	malloc_strcpy(&var->value, value == NULL ? "" : value);
+	/* The found paths of commands depend on PATH */
+	if (strcmp(name, "PATH") == 0 &&
+		(old == NULL || strcmp(old, var->value) != 0)) {
+		forget_commands();
+	}
+	free(old);
+}
+
+/*
+ * Removes variable name.
+ */
+void var_unset(char const *name) {
+	struct var **var, *gone;
+	var = &vars[fnv1a(name, strlen(name), 0) & (VAR_BUCKETS - 1)];
+	for (; *var != NULL; var = &(*var)->next) {
+		if (strcmp((*var)->name, name) != 0) continue;
+		gone = *var;
+		*var = gone->next;
+		if (gone->exported) envp_dirty = 1;
+		if (strcmp(name, "PATH") == 0) forget_commands();
+		free(gone->name);
+		free(gone->value);
+		free(gone);
+		return;
+	}
+}
+
+/*
+ * Sets a variable from an assignment NAME=value, see var_set() for exported.
+ * Returns 0 on success, or -1 if s is not an assignment.
+ */
+int var_assign(char const *s, int exported) {
+	char *name;
+	char const *eq = strchr(s, '=');
+	if (eq == NULL || !valid_name(s, eq - s)) return -1;
+	malloc_strcpy(&name, s);
+	name[eq - s] = '\0';
+	var_set(name, eq + 1, exported);
+	free(name);
+	return 0;
+}
+
+/*
+ * Returns the exported variables as a NULL-terminated array of NAME=value
+ * strings, rebuilt if any exported variable changed since the last call.
+ */
+char *const *get_envp(void) {
+	int i, n = 0;
+	struct var *var;
+	if (!envp_dirty) return envp;
+	free_strs(envp);
+	free(envp);
+	for (i = 0; i < VAR_BUCKETS; i++) {
+		for (var = vars[i]; var != NULL; var = var->next) n += var->exported;
+	}
+	envp = malloc((n + 1) * sizeof(char *));
+	for (i = n = 0; i < VAR_BUCKETS; i++) {
+		for (var = vars[i]; var != NULL; var = var->next) {
+			if (!var->exported) continue;
+			envp[n] = malloc(strlen(var->name) + strlen(var->value) + 2);
+			sprintf(envp[n++], "%s=%s", var->name, var->value);
+		}
+	}
+	envp[n] = NULL;
+	envp_dirty = 0;
+	return envp;
+}
+
+/*
+ * Returns the path of command name, searched for in PATH. Found paths are
+ * kept until PATH changes or "hash -r". Names with a slash are returned as
+ * they are if they are executable files. Returns NULL if the command is not
+ * found, or if there is no PATH, and then sets *err, unless err is NULL, to
+ * the errno that exec would fail with.
+ */
+char const *find_command(char const *name, int *err) {
+	char const *dir, *end, *path = var_get("PATH");
+	char *file;
+	int e = ENOENT;
+	struct stat st;
+	struct var *cmd;
+	if (strchr(name, '/') != NULL) {
+		if (stat(name, &st) == -1 || access(name, X_OK) == -1) {
+			e = errno;
+		} else if (!S_ISREG(st.st_mode)) {
+			e = EACCES;
+		} else {
+			return name;
+		}
+		if (err != NULL) *err = e;
+		return NULL;
+	}
+	if (err != NULL) *err = ENOENT;
+	if (path == NULL) return NULL;
+	if ((cmd = var_lookup(cmd_paths, name, 0)) != NULL) return cmd->value;
+	file = malloc(strlen(path) + strlen(name) + 2);
+	for (dir = path; ; dir = end + 1) {
+		end = dir + strcspn(dir, ":");
+		if (end == dir) {
+			sprintf(file, "%s", name); /* empty means current directory */
+		} else {
+			sprintf(file, "%.*s/%s", (int)(end - dir), dir, name);
+		}
+		if (stat(file, &st) == 0 && S_ISREG(st.st_mode) &&
+			access(file, X_OK) == 0) {
+			cmd = var_lookup(cmd_paths, name, 1);
+			cmd->value = file;
+			return file;
+		}
+		if (*end == '\0') break;
+	}
+	free(file);
+	return NULL;
+}
+
+/*
+ * Forgets the found paths of all commands, and the command trie.
+ */
+void forget_commands(void) {
+	int i;
+	struct var *cmd;
+	trie_free(cmd_trie);
+	cmd_trie = NULL;
+	cmd_gen++;
+	for (i = 0; i < VAR_BUCKETS; i++) {
+		while ((cmd = cmd_paths[i]) != NULL) {
+			cmd_paths[i] = cmd->next;
+			free(cmd->name);
+			free(cmd->value);
+			free(cmd);
+		}
+	}
+}
+
+/*
+ * Returns 1 if the first len characters of s are a valid variable name, else
+ * 0.
+ */
+int valid_name(char const *s, size_t len) {
+	size_t i;
+	if (len == 0 || isdigit((unsigned char)s[0])) return 0;
+	for (i = 0; i < len; i++) {
+		if (!isalnum((unsigned char)s[i]) && s[i] != '_') return 0;
+	}
+	return 1;
+}
+
+/*------------------------------------------------------------------------------
+ * SCRIPTS
+ *
+ * A script is compiled once to bytecode and then run by a small interpreter,
+ * so that the lines of a loop body are not tokenized again on every iteration.
+ * Each line is one of:
+ *
+ *   # comment
+ *   NAME=value
+ *   cmd [args] [| cmd [args]]... [&]
+ *   while cmd [args] [| ...]     ...  done
+ *   for NAME in [words]          ...  done
+ *   if cmd [args] [| ...]        ...  [else  ...]  fi
+ *   break, continue, exit [status]
+ *
+ * Lines with only "do" or "then" are ignored. Arguments may refer to variables
+ * as $NAME or ${NAME}, the status of the last pipeline is $? and the script
+ * arguments are $0, $1, etc.
+ */
+
+/*
+ * Compiles and runs the script args[0] with the following arguments. Returns
+ * the exit status of the script.
+ */
+int run_script(int no_args, char **args) {
+	char name[16];
+	int i, status;
+	struct program prog;
+	for (i = 0; i < no_args; i++) {
+		sprintf(name, "%d", i);
+		var_set(name, args[i], 0);
+	}
+	if (load_script(&prog, args[0]) == -1) return EXIT_FAILURE;
+	prog.resolved = calloc(prog.no_pool, sizeof(struct resolved *));
+	status = run_program(&prog);
+	free_program(&prog);
+	return status;
+}
+
+/*
+ * Loads the script at path to prog, from the cache if it has an entry for the
+ * same path, size, modification time and content, else by compiling it and
+ * storing the result in the cache. Returns 0 on success, else -1.
+ */
+int load_script(struct program *prog, char const *path) {
+	char *file, *real, *text;
+	int result;
+	struct program_header key;
+	struct stat st;
+	FILE *fp;
+	if ((fp = fopen(path, "r")) == NULL || fstat(fileno(fp), &st) == -1) {
+		fprintf(stderr, "load_script: Could not open '%s'\n", path);
+		if (fp != NULL) fclose(fp);
+		return -1;
+	}
+	text = malloc(st.st_size + 1);
+	text[fread(text, 1, st.st_size, fp)] = '\0';
+	fclose(fp);
+	memset(&key, 0, sizeof(key));
+	memcpy(key.magic, CACHE_MAGIC, sizeof(key.magic));
+	real = realpath(path, NULL);
+	if (real == NULL) malloc_strcpy(&real, path);
+	key.path_hash = fnv1a(real, strlen(real), 0);
+	free(real);
+	key.size = st.st_size;
+	key.mtime_sec = st.st_mtim.tv_sec;
+	key.mtime_nsec = st.st_mtim.tv_nsec;
+	key.hash = fnv1a(text, st.st_size, 0);
+	file = cache_file(&key);
+	if (file != NULL && load_cached(prog, file, &key) == 0) {
+		result = 0;
+	} else if ((result = compile_script(prog, path, text)) == 0 && file) {
+		store_cached(prog, file, &key);
+	}
+	free(file);
+	free(text);
+	return result;
+}
+
+/*
+ * Maps the cached program in file to prog if it matches key. The code is
+ * checked so that a damaged entry can not make the interpreter go astray.
+ * Returns 0 on success, else -1.
+ */
+int load_cached(struct program *prog, char const *file,
+	struct program_header const *key) {
+	char *base;
+	int fd, i, ok;
+	size_t len;
+	struct program_header const *head;
+	struct insn const *in;
+	struct stat st;
+	if ((fd = open(file, O_RDONLY)) == -1) return -1;
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(*head)) {
+		close(fd);
+		return -1;
+	}
+	len = st.st_size;
+	base = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) return -1;
+	head = (struct program_header const *)base;
+	ok = (memcmp(head, key, offsetof(struct program_header, no_insns)) == 0 &&
+		head->no_insns >= 0 && head->no_pool >= 0 && head->strs_len > 0 &&
+		head->no_loops >= 0 && len == sizeof(*head) +
+		head->no_insns * sizeof(struct insn) +
+		head->no_pool * sizeof(int) + head->strs_len &&
+		base[len - 1] == '\0');
+	memset(prog, 0, sizeof(*prog));
+	prog->code = (struct insn *)(base + sizeof(*head));
+	prog->pool = (int *)(prog->code + (ok ? head->no_insns : 0));
+	prog->strs = (char *)(prog->pool + (ok ? head->no_pool : 0));
+	for (i = 0; ok && i < head->no_insns; i++) {
+		in = &prog->code[i];
+		ok = (in->op >= 0 && in->op < NO_OPS);
+		if (ok && (in->op == OP_SPAWN || in->op == OP_TEST)) {
+			ok = valid_pipeline(prog, head, in->a);
+		}
+		if (ok && (in->op == OP_JUMP || in->op == OP_JUMP_FALSE)) {
+			ok = (in->a >= 0 && in->a <= head->no_insns);
+		}
+		if (ok && in->op == OP_SET) {
+			ok = (in->a >= 0 && in->a < head->strs_len &&
+				in->b >= 0 && in->b < head->strs_len);
+		}
+		if (ok && (in->op == OP_FOR_INIT || in->op == OP_FOR_NEXT)) {
+			ok = (in->a >= 0 && in->a < head->no_loops && in->b >= 0 &&
+				in->b < head->strs_len && in->c >= 0 &&
+				in->c <= head->no_insns);
+		}
+	}
+	if (!ok) {
+		munmap(base, len);
+		return -1;
+	}
+	prog->no_insns = head->no_insns;
+	prog->no_pool = head->no_pool;
+	prog->strs_len = head->strs_len;
+	prog->no_loops = head->no_loops;
+	prog->map = base;
+	prog->map_len = len;
+	return 0;
+}
+
+/*
+ * Returns 1 if the pipeline at pool offset p of a cached program is whole:
+ * the numbers of commands and arguments are within MAX_CMDS and MAX_ARGS and
+ * every argument is in strs, which ends in NUL, else 0.
+ */
+int valid_pipeline(struct program const *prog,
+	struct program_header const *head, int p) {
+	int cmd, i, no_args, no_cmds;
+	if (p < 0 || p >= head->no_pool) return 0;
+	no_cmds = prog->pool[p++];
+	if (no_cmds < 1 || no_cmds > MAX_CMDS) return 0;
+	for (cmd = 0; cmd < no_cmds; cmd++) {
+		if (p >= head->no_pool) return 0;
+		no_args = prog->pool[p++];
+		if (no_args < 1 || no_args > MAX_ARGS ||
+			no_args > head->no_pool - p) {
+			return 0;
+		}
+		for (i = 0; i < no_args; i++, p++) {
+			if (prog->pool[p] < 0 || (prog->pool[p] >> 1) >= head->strs_len) {
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+/*
+ * Stores a compiled program in file. The entry is written to a temporary file
+ * first and then renamed, so that a concurrent load never sees half an entry.
+ */
+void store_cached(struct program const *prog, char const *file,
+	struct program_header const *key) {
+	char *tmp = malloc(strlen(file) + 32);
+	int fd, ok;
+	struct program_header head = *key;
+	head.no_insns = prog->no_insns;
+	head.no_pool = prog->no_pool;
+	head.strs_len = prog->strs_len;
+	head.no_loops = prog->no_loops;
+	sprintf(tmp, "%s.%d", file, (int)getpid());
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1) {
+		free(tmp);
+		return;
+	}
+	ok = (write(fd, &head, sizeof(head)) == sizeof(head) &&
+		write(fd, prog->code, prog->no_insns * sizeof(struct insn)) ==
+		(ssize_t)(prog->no_insns * sizeof(struct insn)) &&
+		write(fd, prog->pool, prog->no_pool * sizeof(int)) ==
+		(ssize_t)(prog->no_pool * sizeof(int)) &&
+		write(fd, prog->strs, prog->strs_len) == prog->strs_len);
+	if (close(fd) == -1 || !ok || rename(tmp, file) == -1) unlink(tmp);
+	free(tmp);
+}
+
+/*
+ * Returns the allocated name of the cache entry for key, in
+ * $XDG_CACHE_HOME/tj_shell or ~/.cache/tj_shell which is created if needed.
+ * Returns NULL if there is no such directory.
+ */
+char *cache_file(struct program_header const *key) {
+	char const *dir = var_get("XDG_CACHE_HOME"), *home = var_get("HOME");
+	char *file;
+	if (dir == NULL && home == NULL) return NULL;
+	file = malloc(strlen(dir != NULL ? dir : home) + 64);
+	if (dir != NULL) {
+		sprintf(file, "%s/tj_shell", dir);
+	} else {
+		sprintf(file, "%s/.cache", home);
+		mkdir(file, 0700);
+		strcat(file, "/tj_shell");
+	}
+	if (mkdir(file, 0700) == -1 && errno != EEXIST) {
+		free(file);
+		return NULL;
+	}
+	sprintf(file + strlen(file), "/%016lx.tjc", key->path_hash);
+	return file;
+}
+
+/*
+ * Compiles the script text read from path to prog. Returns 0 on success, else
+ * -1 after printing the reason.
+ */
+int compile_script(struct program *prog, char const *path, char *text) {
+	char *line, *next;
+	int depth = 0, line_no;
+	struct block blocks[MAX_BLOCKS];
+	memset(prog, 0, sizeof(*prog));
+	for (line = text, line_no = 1; line != NULL; line = next, line_no++) {
+		if ((next = strchr(line, '\n')) != NULL) *next++ = '\0';
+		if (compile_line(prog, line, blocks, &depth) == -1) {
+			fprintf(stderr, "compile_script: %s:%d: Syntax error\n",
+				path, line_no);
+			break;
+		}
+	}
+	if (line == NULL && depth > 0) {
+		fprintf(stderr, "compile_script: %s: Missing 'done' or 'fi'\n", path);
+	}
+	if (line != NULL || depth > 0) {
+		free_program(prog);
+		return -1;
+	}
+	/* At least one string, so that a cached program is never empty */
+	prog_str(prog, "");
+	return 0;
+}
+
+/*
+ * Compiles one line of a script. The stack blocks holds the enclosing loops
+ * and conditionals and depth is its size. Returns 0 on success, else -1.
+ */
+int compile_line(struct program *prog, char *line, struct block *blocks,
+	int *depth) {
+	char *end, first[16], *rest, *word;
+	int loop, name, p, pc, top = *depth - 1;
+	size_t len;
+	/* Trim blanks, then split off the first word (a keyword if any) */
+	line += strspn(line, " \t");
+	end = line + strlen(line);
+	while (end > line && strchr(" \t\r", end[-1]) != NULL) *--end = '\0';
+	if (*line == '\0' || *line == '#') return 0;
+	len = strcspn(line, " \t");
+	first[0] = '\0';
+	if (len < sizeof(first)) sprintf(first, "%.*s", (int)len, line);
+	rest = line + len + strspn(line + len, " \t");
+	if (strcmp(first, "while") == 0 || strcmp(first, "if") == 0) {
+		if (*depth == MAX_BLOCKS || (p = compile_pipeline(prog, rest)) < 0) {
+			return -1;
+		}
+		pc = prog_emit(prog, OP_TEST, p, 0, 0);
+		blocks[*depth].type = (*first == 'w' ? BLOCK_WHILE : BLOCK_IF);
+		blocks[(*depth)++].pc = (*first == 'w' ? pc : pc + 1);
+		prog_emit(prog, OP_JUMP_FALSE, -1, 0, 0);
+		return 0;
+	}
+	if (strcmp(first, "for") == 0) {
+		if (*depth == MAX_BLOCKS || (word = strtok(rest, " \t")) == NULL) {
+			return -1;
+		}
+		name = prog_str(prog, word);
+		if ((word = strtok(NULL, " \t")) == NULL || strcmp(word, "in") != 0) {
+			return -1;
+		}
+		word = strtok(NULL, "");
+		p = prog_str(prog, word == NULL ? "" : word);
+		prog_emit(prog, OP_FOR_INIT, prog->no_loops, p, 0);
+		blocks[*depth].type = BLOCK_FOR;
+		blocks[(*depth)++].pc = prog_emit(prog, OP_FOR_NEXT,
+			prog->no_loops++, name, -1);
+		return 0;
+	}
+	if (strcmp(first, "exit") == 0) {
+		prog_emit(prog, OP_EXIT, *rest == '\0' ? -1 : atoi(rest), 0, 0);
+		return 0;
+	}
+	if (strcmp(first, "do") == 0 || strcmp(first, "then") == 0) {
+		return (*rest == '\0' ? 0 : -1);
+	}
+	if (strcmp(first, "else") == 0) {
+		if (*rest != '\0' || top < 0 || blocks[top].type != BLOCK_IF) {
+			return -1;
+		}
+		pc = prog_emit(prog, OP_JUMP, -1, 0, 0);
+		prog->code[blocks[top].pc].a = prog->no_insns;
+		blocks[top].type = BLOCK_ELSE;
+		blocks[top].pc = pc;
+		return 0;
+	}
+	if (strcmp(first, "fi") == 0) {
+		if (*rest != '\0' || top < 0 || blocks[top].type < BLOCK_IF) {
+			return -1;
+		}
+		prog->code[blocks[top].pc].a = prog->no_insns;
+		(*depth)--;
+		return 0;
+	}
+	if (strcmp(first, "done") == 0) {
+		if (*rest != '\0' || top < 0 || blocks[top].type > BLOCK_FOR) {
+			return -1;
+		}
+		prog_emit(prog, OP_JUMP, blocks[top].pc, 0, 0);
+		if (blocks[top].type == BLOCK_WHILE) {
+			prog->code[blocks[top].pc + 1].a = prog->no_insns;
+		} else {
+			prog->code[blocks[top].pc].c = prog->no_insns;
+		}
+		/* Patch the breaks of this loop */
+		for (pc = blocks[top].pc; pc < prog->no_insns; pc++) {
+			if (prog->code[pc].op == OP_JUMP &&
+				prog->code[pc].a == BREAK_MARK(top)) {
+				prog->code[pc].a = prog->no_insns;
+			}
+		}
+		(*depth)--;
+		return 0;
+	}
+	if (strcmp(first, "break") == 0 || strcmp(first, "continue") == 0) {
+		for (loop = top; loop >= 0 && blocks[loop].type > BLOCK_FOR; loop--);
+		if (*rest != '\0' || loop < 0) return -1;
+		prog_emit(prog, OP_JUMP,
+			*first == 'b' ? BREAK_MARK(loop) : blocks[loop].pc, 0, 0);
+		return 0;
+	}
+	/* NAME=value */
+	if (*rest == '\0' && (end = strchr(line, '=')) != NULL &&
+		valid_name(line, end - line)) {
+		*end = '\0';
+		name = prog_str(prog, line);
+		prog_emit(prog, OP_SET, name, prog_str(prog, end + 1), 0);
+		return 0;
+	}
+	if ((p = compile_pipeline(prog, line)) < 0) return -1;
+	prog_emit(prog, OP_SPAWN, p, 0, 0);
+	return 0;
+}
+
+/*
+ * Compiles a command line to a pipeline in the pool of prog. Returns its pool
+ * offset, or if a command is empty minus the number of that command.
+ */
+int compile_pipeline(struct program *prog, char const *line) {
+	char **args = malloc((MAX_ARGS+1) * sizeof(char *));
+	char **cmds = malloc((MAX_CMDS+1) * sizeof(char *));
+	int i, j, no_args, no_cmds, p;
+	/* Get commands from the command line */
+	tokenize(cmds, &no_cmds, line, "|");
+	p = prog_int(prog, no_cmds);
+	if (no_cmds == 0) p = -1;
+	for (i = 0; i < no_cmds && p >= 0; i++) {
+		tokenize(args, &no_args, cmds[i], " ");
+		if (no_args == 0) p = -(i + 1);
+		prog_int(prog, no_args);
+		for (j = 0; j < no_args; j++) {
+			prog_int(prog, prog_str(prog, args[j]) << 1 |
+				(strchr(args[j], '$') != NULL));
+		}
+		free_strs(args);
+	}
+	free_strs(cmds);
+	free(args);
+	free(cmds);
+	return p;
+}
+
+/*
+ * Appends an instruction to prog and returns its program counter.
+ */
+int prog_emit(struct program *prog, int op, int a, int b, int c) {
+	struct insn *in;
+	prog->code = grow(prog->code, &prog->code_cap, prog->no_insns + 1,
+		sizeof(struct insn));
+	in = &prog->code[prog->no_insns];
+	in->op = op;
+	in->a = a;
+	in->b = b;
+	in->c = c;
+	return prog->no_insns++;
+}
+
+/*
+ * Appends an integer to the pool of prog and returns its offset.
+ */
+int prog_int(struct program *prog, int value) {
+	prog->pool = grow(prog->pool, &prog->pool_cap, prog->no_pool + 1,
+		sizeof(int));
+	prog->pool[prog->no_pool] = value;
+	return prog->no_pool++;
+}
+
+/*
+ * Appends a string to the strings of prog and returns its offset.
+ */
+int prog_str(struct program *prog, char const *s) {
+	int len = strlen(s) + 1, offset = prog->strs_len;
+	prog->strs = grow(prog->strs, &prog->strs_cap, offset + len, 1);
+	memcpy(prog->strs + offset, s, len);
+	prog->strs_len += len;
+	return offset;
+}
+
+/*
+ * Frees the parts of a compiled program, or unmaps it if it is cached.
+ */
+void free_program(struct program *prog) {
+	int i;
+	for (i = 0; prog->resolved != NULL && i < prog->no_pool; i++) {
+		free(prog->resolved[i]);
+	}
+	free(prog->resolved);
+	if (prog->map != NULL) {
+		munmap(prog->map, prog->map_len);
+	} else {
+		free(prog->code);
+		free(prog->pool);
+		free(prog->strs);
+	}
+	memset(prog, 0, sizeof(*prog));
+}
+
+/*
+ * Runs a compiled program, the operations are dispatched through the table
+ * vm_ops. Returns the exit status.
+ */
+int run_program(struct program const *prog) {
+	int i;
+	struct insn const *in;
+	struct vm vm;
+	vm.prog = prog;
+	vm.loops = calloc(prog->no_loops + 1, sizeof(struct vm_loop));
+	vm.pc = 0;
+	vm.cond = 0;
+	while (vm.pc >= 0 && vm.pc < prog->no_insns) {
+		in = &prog->code[vm.pc++];
+		vm_ops[in->op](&vm, in);
+	}
+	for (i = 0; i < prog->no_loops; i++) {
+		free_strs(vm.loops[i].words);
+		free(vm.loops[i].words);
+	}
+	free(vm.loops);
+	return last_status;
+}
+
+/*
+ * OP_SPAWN.
+ */
+void vm_spawn(struct vm *vm, struct insn const *in) {
+	exec_pipeline(vm->prog, in->a);
+	sig_drain(NULL);
+}
+
+/*
+ * OP_TEST.
+ */
+void vm_test(struct vm *vm, struct insn const *in) {
+	exec_pipeline(vm->prog, in->a);
+	vm->cond = (last_status == 0);
+}
+
+/*
+ * OP_JUMP.
+ */
+void vm_jump(struct vm *vm, struct insn const *in) {
+	vm->pc = in->a;
+}
+
+/*
+ * OP_JUMP_FALSE.
+ */
+void vm_jump_false(struct vm *vm, struct insn const *in) {
+	if (!vm->cond) vm->pc = in->a;
+}
+
+/*
+ * OP_SET.
+ */
+void vm_set(struct vm *vm, struct insn const *in) {
+	char *value = expand_word(vm->prog->strs + in->b);
+	var_set(vm->prog->strs + in->a, value, -1);
+	free(value);
+}
+
+/*
+ * OP_FOR_INIT.
+ */
+void vm_for_init(struct vm *vm, struct insn const *in) {
+	char *list = expand_word(vm->prog->strs + in->b);
+	struct vm_loop *loop = &vm->loops[in->a];
+	free_strs(loop->words);
+	free(loop->words);
+	loop->words = malloc((strlen(list) / 2 + 2) * sizeof(char *));
+	tokenize(loop->words, &loop->no_words, list, " \t");
+	loop->next = 0;
+	free(list);
+}
+
+/*
+ * OP_FOR_NEXT.
+ */
+void vm_for_next(struct vm *vm, struct insn const *in) {
+	struct vm_loop *loop = &vm->loops[in->a];
+	if (loop->next < loop->no_words) {
+		var_set(vm->prog->strs + in->b, loop->words[loop->next++], -1);
+	} else {
+		vm->pc = in->c;
+	}
+}
+
+/*
+ * OP_EXIT.
+ */
+void vm_exit(struct vm *vm, struct insn const *in) {
+	if (in->a >= 0) last_status = in->a;
+	vm->pc = -1;
+}
+
+/*------------------------------------------------------------------------------
+ * HELPER FUNCTIONS
+ */
+
+/*
+ * Returns the id of the job of child pid, or 0 if it is not a job.
+ */
+int job_of(pid_t pid) {
+	int id = (job_cap > 0 ? job_buckets[pid & (job_cap - 1)] : 0);
+	while (id != 0 && jobs[id].pid != pid) id = jobs[id].next;
+	return id;
+}
+
+/*
+ * Makes child pid of process group pgid a job in state, with the command of
+ * the running pipeline, or sets the state of the job it is. The lowest free
+ * id is taken, the table grows if there is none. Returns the id.
+ */
+int add_job(pid_t pid, pid_t pgid, int state) {
+	int *bucket, cap = job_cap, id;
+	if ((id = job_of(pid)) == 0) {
+		for (id = 1; id < job_cap && jobs[id].pid != 0; id++);
+		if (id >= job_cap) {
+			/* Full, twice the slots and buckets and the jobs hashed again */
+			jobs = grow(jobs, &job_cap, cap == 0 ? JOBS_MIN : cap + 1,
+				sizeof(struct job_slot));
+			memset(jobs + cap, 0, (job_cap - cap) * sizeof(struct job_slot));
+			job_buckets = grow(job_buckets, &cap, job_cap, sizeof(int));
+			memset(job_buckets, 0, job_cap * sizeof(int));
+			for (id = 1; jobs[id].pid != 0; id++) {
+				bucket = &job_buckets[jobs[id].pid & (job_cap - 1)];
+				jobs[id].next = *bucket;
+				*bucket = id;
+			}
+		}
+		jobs[id].pid = pid;
+		jobs[id].pgid = pgid;
+		strcpy(jobs[id].cmd, job.cmd);
+		bucket = &job_buckets[pid & (job_cap - 1)];
+		jobs[id].next = *bucket;
+		*bucket = id;
+		no_jobs++;
+	}
+	jobs[id].state = state;
+	job_current = id;
+	return id;
+}
+
+/*
+ * Updates the job of child pid, if it is one, with its wait status.
+ */
+void update_job(pid_t pid, int status) {
+	int id = job_of(pid);
+	if (id == 0 || jobs[id].state == JOB_DONE) return;
+	if (WIFSTOPPED(status)) {
+		jobs[id].state = JOB_STOPPED;
+		jobs[id].status = 128 + WSTOPSIG(status);
+		job_current = id;
+		return;
+	}
+	jobs[id].state = JOB_DONE;
+	jobs[id].status = (WIFSIGNALED(status) ? 128 + WTERMSIG(status) :
+		WEXITSTATUS(status));
+	no_jobs--;
+}
+
+/*
+ * Forgets job id.
+ */
+void free_job(int id) {
+	int *p = &job_buckets[jobs[id].pid & (job_cap - 1)];
+	while (*p != id) p = &jobs[*p].next;
+	*p = jobs[id].next;
+	if (jobs[id].state != JOB_DONE) no_jobs--;
+	jobs[id].pid = 0;
+	if (job_current == id) job_current = 0;
+}
+
+/*
+ * Returns the id of the job given by spec, %n or the pid of a job, or of the
+ * latest job if spec is NULL. If there is no such job 0 is returned and the
+ * built in command name says so.
+ */
+int find_job(char const *spec, char const *name) {
+	int id = job_current;
+	if (spec != NULL && spec[0] == '%') {
+		id = atoi(spec + 1);
+		if (id < 1 || id >= job_cap || jobs[id].pid == 0) id = 0;
+	} else if (spec != NULL) {
+		id = job_of(atoi(spec));
+	}
+	if (id == 0) fprintf(stderr, "%s: No such job\n", name);
+	return id;
+}
+
+/*
+ * Returns 1 if the shell has a child that is not a job, nor the zygote, as
+ * found in /proc, else 0.
+ */
+int other_children(void) {
+	char path[STR_LEN+1];
+	DIR *dirp;
+	FILE *fp;
+	int found = 0;
+	pid_t pid, ppid;
+	struct dirent *dent;
+	if ((dirp = opendir("/proc")) == NULL) return 0;
+	while (!found && (dent = readdir(dirp)) != NULL) {
+		if (dent->d_name[0] < '0' || dent->d_name[0] > '9') continue;
+		sprintf(path, "/proc/%s/stat", dent->d_name);
+		if ((fp = fopen(path, "r")) == NULL) continue;
+		if (fscanf(fp, "%d %*s %*c %d", &pid, &ppid) == 2 &&
+			ppid == shell_pid && pid != zygote_pid && job_of(pid) == 0) {
+			found = 1;
+		}
+		fclose(fp);
+	}
+	closedir(dirp);
+	return found;
+}
+
+/*
+ * Sends sig to job id, to its process group if it has one. Returns 0 on
+ * success, else -1.
+ */
+int signal_job(int id, int sig) {
+	if (kill(jobs[id].pgid > 0 ? -jobs[id].pgid : jobs[id].pid, sig) == -1) {
+		perror("kill");
+		return -1;
+	}
+	if (sig == SIGCONT && jobs[id].state == JOB_STOPPED) {
+		jobs[id].state = JOB_RUNNING;
+	}
+	return 0;
+}
+
+/*
+ * Waits until the event loop has run and drains the signal records, for
+ * the jobs to be looked at again. Without signal records, as when polling,
+ * it looks every 10 ms.
+ */
+void wait_job_event(void) {
+	int timeout = (sig_pipe[READ_END] == -1 ? 10 : -1);
+	#ifdef POLLING
+	timeout = 10;
+	#endif
+	if (ev_run_once(timeout) == 0 && ev_epoll == -1) ten_ms_sleep(1);
+	sig_drain(NULL);
+}
+
+/*
+ * Returns an allocated copy of word where $NAME, ${NAME} and $? are replaced by
+ * their values. Undefined variables expand to nothing.
+ */
+char *expand_word(char const *word) {
+	char *name, *s, status[16];
+	char const *value;
+	int cap = strlen(word) + 1, len = 0, n;
+	s = malloc(cap);
+	while (*word != '\0') {
+		n = strcspn(word, "$");
+		if (n == 0 && word[1] == '?') {
+			sprintf(status, "%d", last_status);
+			value = status;
+			word += 2;
+		} else if (n == 0) {
+			word++;
+			n = (*word == '{' ? strcspn(++word, "}") : strspn(word,
+				"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+				"0123456789_"));
+			name = malloc(n + 1);
+			sprintf(name, "%.*s", n, word);
+			value = (n == 0 ? "$" : var_get(name));
+			word += n + (word[-1] == '{' && word[n] == '}');
+			free(name);
+		} else {
+			value = NULL;
+			s = grow(s, &cap, len + n + 1, 1);
+			memcpy(s + len, word, n);
+			len += n;
+			word += n;
+		}
+		if (value != NULL) {
+			n = strlen(value);
+			s = grow(s, &cap, len + n + 1, 1);
+			memcpy(s + len, value, n);
+			len += n;
+		}
+	}
+	s[len] = '\0';
+	return s;
+}
+
+/*
+ * Returns the 64 bit FNV-1a hash of len bytes of data, continuing from hash h
+ * or starting over if h is 0.
+ */
+unsigned long fnv1a(void const *data, size_t len, unsigned long h) {
+	unsigned char const *p = data;
+	if (h == 0) h = 14695981039346656037UL;
+	while (len-- > 0) h = (h ^ *p++) * 1099511628211UL;
+	return h;
+}
+
+/*
+ * Frees a NULL-terminated array of allocated strings, but not the array.
+ */
+void free_strs(char **strs) {
+	int i;
+	if (strs == NULL) return;
+	for (i = 0; strs[i] != NULL; i++) free(strs[i]);
+}
+
+/*
+ * Returns array, reallocated if needed so that it has room for at least need
+ * elements of the given size. The capacity cap is updated.
+ */
+void *grow(void *array, int *cap, int need, size_t size) {
+	if (need <= *cap) return array;
+	*cap = (need > 2 * *cap ? need : 2 * *cap);
+	if ((array = realloc(array, *cap * size)) == NULL) {
+		fprintf(stderr, "grow: Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	return array;
+}
+
+/*
+ * Takes dest a pointer to a string and src the source string. The function
+ * allocates memory for dest and copies src to it.
+ */
+void malloc_strcpy(char **dest, char const *src) {
+	if (src == NULL) {*dest = NULL; return;}
+	*dest = malloc((strlen(src)+1) * sizeof(char)); /* +1 for null-terminated */
+	sprintf(*dest, "%s", src);
+}
+
+/*
+ * Shows len bytes of text in the pager selected primarily based on the value
+ * of the users "PAGER" environment variable. If no such variable is set then
+ * "less" is used, or if it can not be found "more". Returns 0 on success,
+ * else -1.
+ */
+int page(char const *text, size_t len) {
+	char **args = malloc((MAX_ARGS+1) * sizeof(char *)), *const *env;
+	char const *pager = var_get("PAGER"), *path;
+	int fds[2], no_args, status = -1;
+	pid_t c_pid;
+	sigset_t chld, old_mask;
+	void (*old_pipe)(int);
+	tokenize(args, &no_args, pager != NULL ? pager : "less", " ");
+	if (no_args == 0) {
+		free(args);
+		return -1;
+	}
+	if ((path = find_command(args[0], NULL)) == NULL && pager == NULL) {
+		path = find_command("more", NULL);
+	}
+	if (path == NULL) {
+		fprintf(stderr, "page: Could not run '%s'\n", args[0]);
+		free_strs(args);
+		free(args);
+		return -1;
+	}
+	env = get_envp();
+	if (pipe(fds) == -1) {
+		fprintf(stderr, "page: Could not pipe\n");
+		free_strs(args);
+		free(args);
+		return -1;
+	}
+	sigemptyset(&chld);
+	sigaddset(&chld, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &chld, &old_mask);
+	fflush(stdout);
+	if ((c_pid = fork()) == 0) {
+		sigprocmask(SIG_SETMASK, &old_mask, NULL);
+		c_init(1, 0, -1, NULL);
+		pipe_to_stdin(fds);
+		execve(path, args, env);
+		fprintf(stderr, "page: Could not run '%s'\n", args[0]);
+		_exit(EXIT_FAILURE);
+	}
+	close(fds[READ_END]);
+	if (c_pid > 0) {
+		/* The pager may quit before reading everything */
+		old_pipe = signal(SIGPIPE, SIG_IGN);
+		write_all(fds[WRITE_END], text, len);
+		close(fds[WRITE_END]);
+		signal(SIGPIPE, old_pipe);
+		status = (c_wait(c_pid, NULL, 0) == 0 ? 0 : -1);
+	} else {
+		close(fds[WRITE_END]);
+		fprintf(stderr, "page: Could not fork\n");
+	}
+	sigprocmask(SIG_SETMASK, &old_mask, NULL);
+	free_strs(args);
+	free(args);
+	return status;
+}
+
+/*
+ * Print childs wait status.
+ */
+void print_status(pid_t c_pid, int status) {
+	int timed_out = (!WIFSTOPPED(status) && timer_reaped(c_pid));
+	if (!interactive) return;
+	if (timed_out) {
+		fprintf(stdout, "[%d] Timed out\n", c_pid);
+	} else if (WIFEXITED(status)) {
+		fprintf(stdout, "[%d] Terminated normally\n", c_pid);
+	} else if (WIFSIGNALED(status)) {
+		fprintf(stdout, "[%d] Terminated by a signal\n", c_pid);
+	} else if (WIFSTOPPED(status)) {
+		fprintf(stdout, "[%d] Stopped\n", c_pid);
+	}
+}
+
+/*
+ * Starts a detached worker thread running fn, with a pipe in fds for it to
+ * notify the shell on unless fds is NULL. Returns 0 on success, else -1.
+ */
+int start_worker(void *(*fn)(void *), int fds[2]) {
+	int failed;
+	pthread_t thread;
+	sigset_t all, old_mask;
+	if (fds != NULL) {
+		if (pipe(fds) == -1) return -1;
+		fcntl(fds[READ_END], F_SETFL, O_NONBLOCK);
+		fcntl(fds[READ_END], F_SETFD, FD_CLOEXEC);
+		fcntl(fds[WRITE_END], F_SETFD, FD_CLOEXEC);
+	}
+	/* Signals are for the shell, the worker blocks them all */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old_mask);
+	failed = pthread_create(&thread, NULL, fn, NULL);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+	if (failed && fds != NULL) {
+		close(fds[READ_END]);
+		close(fds[WRITE_END]);
+		fds[READ_END] = fds[WRITE_END] = -1;
+	}
+	if (failed) return -1;
+	pthread_detach(thread);
+	return 0;
+}
+
+/*
+ * Pipes stdout to a pipe.
+ */
+void stdout_to_pipe(int const *pipe_fd) {
+	close(pipe_fd[READ_END]);
+	close(STDOUT_FILENO);
+	if (dup2(pipe_fd[WRITE_END], STDOUT_FILENO) == -1) perror("dup2");
+}
+
+/*
+ * Pipes a pipe to stdin.
+ */
+void pipe_to_stdin(int const *pipe_fd) {
+	close(pipe_fd[WRITE_END]);
+	close(STDIN_FILENO);
+	if (dup2(pipe_fd[READ_END], STDIN_FILENO) == -1) perror("dup2");
+}
+
+/*
+ * Sorts n strings with three-way radix quicksort, which compares each
+ * character only about once. All strings have the same first depth
+ * characters.
+ */
+void sort_strs(char **strs, int n, int depth) {
+	char *tmp;
+	int c, gt, i, j, lt, pivot;
+	while (n > 1) {
+		if (n < 16) {
+			/* Insertion sort for few strings */
+			for (i = 1; i < n; i++) {
+				for (j = i; j > 0 &&
+					strcmp(strs[j-1] + depth, strs[j] + depth) > 0; j--) {
+					tmp = strs[j];
+					strs[j] = strs[j-1];
+					strs[j-1] = tmp;
+				}
+			}
+			return;
+		}
+		tmp = strs[0];
+		strs[0] = strs[n/2];
+		strs[n/2] = tmp;
+		pivot = (unsigned char)strs[0][depth];
+		/* Partition into less than, equal to and greater than pivot */
+		for (lt = 0, i = 1, gt = n - 1; i <= gt;) {
+			c = (unsigned char)strs[i][depth];
+			if (c < pivot) {
+				tmp = strs[lt];
+				strs[lt++] = strs[i];
+				strs[i++] = tmp;
+			} else if (c > pivot) {
+				tmp = strs[gt];
+				strs[gt--] = strs[i];
+				strs[i] = tmp;
+			} else {
+				i++;
+			}
+		}
+		sort_strs(strs, lt, depth);
+		if (pivot != 0) sort_strs(strs + lt, gt - lt + 1, depth + 1);
+		strs += gt + 1;
+		n -= gt + 1;
+	}
+}
+
+/*
+ * Sleeps ten milliseconds using nanosleep for so many times that is given.
+ */
+void ten_ms_sleep(int times) {
+	int i;
+	struct timespec ts;
+	ts.tv_sec = 0;
+	ts.tv_nsec = 10000000; /* 10 ms */
+	/* Nanosleep gets interupted by signals */
+	for (i = 0; i < times; i++) {
+		nanosleep(&ts, NULL);
+	}
+}
+
+/*
+ * Tokenizes a string for specified delimiters. The variable strs is an array of
+ * unallocated strings and no_strs gives the number of output strings. The
+ * allocation after the last string in strs is set to NULL.
+ */
+void tokenize(char **strs, int *no_strs, char const *input, char const *delim) {
+	char *s;
+	int i;
+	malloc_strcpy(&s, input);
+	malloc_strcpy(&strs[i = 0], strtok(s, delim));
+	while(strs[i] != NULL) {
+		malloc_strcpy(&strs[++i], strtok(NULL, delim));
+	}
+	*no_strs = i;
+	free(s);
+}
+
+/*
+ * Writes len bytes of buf to fd, retrying on partial writes. Returns 0 on
+ * success, else -1.
+ */
+int write_all(int fd, void const *buf, size_t len) {
+	char const *p = buf;
+	ssize_t n;
+	while (len > 0) {
+		if ((n = write(fd, p, len)) == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}